@@ -0,0 +1,195 @@
+/*
+ * Benchmark of answer encoding, per record type.
+ *
+ * Every query is resolved against a small zone, so the time is spent on
+ * encoding the answer rather than on finding the records. Run with an
+ * optional number of iterations per query:
+ *   bench_encode [iterations] [zone]
+ * If a zone file is given, all of its records are queried in addition, which
+ * is the workload the PGO build is trained on.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "arpa/inet.h"
+#include "../emdns.h"
+#include "../masterfile.h"
+
+typedef struct {
+    char* name;
+    dns_record_t type;
+    char* label;
+} bench_query_t;
+
+typedef struct {
+    char name[256];
+    dns_record_t type;
+} zone_query_t;
+
+typedef struct {
+    zone_query_t* queries;
+    uint32_t count;
+    uint32_t size;
+} zone_queries_t;
+
+static bench_query_t queries[] = {
+    {"a.bench.com", RecordA, "A"},
+    {"rrset.bench.com", RecordA, "A x8"},
+    {"bench.com", RecordTXT, "TXT"},
+    {"bench.com", RecordMX, "MX x2"},
+    {"bench.com", RecordNS, "NS x2"},
+    {"bench.com", RecordSOA, "SOA"},
+    {"4.3.2.1.in-addr.arpa", RecordPTR, "PTR"},
+    {"alias.bench.com", RecordCNAME, "CNAME"},
+    {"alias.bench.com", RecordA, "CNAME+A"},
+    {"bench.com", RecordANY, "ANY"},
+};
+
+static void _add(emdns_ctx_t* ctx, char* domain, dns_record_t type, char* response) {
+    if (emdns_add_record(ctx, domain, type, ClassIN, response, 3600) != 0) {
+        fprintf(stderr, "Error: could not add %s\n", domain);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @param name domain name in wire format
+ * @return length of the query
+ */
+static uint16_t _query(char* buffer, char* name, dns_record_t type) {
+    char* p = buffer;
+    memset(p, 0, 12);
+    p[0] = 0x12;
+    p[5] = 1;
+    p += 12;
+    uint16_t name_len = strlen(name) + 1;
+    memcpy(p, name, name_len);
+    p += name_len;
+    uint16_t qtype = htons(type), qclass = htons(ClassIN);
+    memcpy(p, &qtype, 2);
+    memcpy(p + 2, &qclass, 2);
+    return p + 4 - buffer;
+}
+
+static uint64_t _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void _encode_name(char* name, char* wire) {
+    while (*name != 0) {
+        char* dot = strchr(name, '.');
+        uint8_t len = (dot != 0 ? (size_t) (dot - name) : strlen(name));
+        *wire++ = len;
+        memcpy(wire, name, len);
+        wire += len;
+        name += len + (dot != 0);
+    }
+    *wire = 0;
+}
+
+static void _collect(emdns_change_t* record, void* arg) {
+    zone_queries_t* zone = arg;
+    if (record->op != ChangeAdd) {
+        return;
+    }
+    if (zone->count == zone->size) {
+        zone->size = (zone->size == 0 ? 1024 : zone->size * 2);
+        zone->queries = realloc(zone->queries, zone->size * sizeof (zone_query_t));
+        if (zone->queries == 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    strcpy(zone->queries[zone->count].name, record->domain);
+    zone->queries[zone->count++].type = record->record_type;
+}
+
+/**
+ * Query all records of a zone file.
+ */
+static void _bench_zone(char* path, uint32_t iterations) {
+    FILE* file = fopen(path, "r");
+    emdns_ctx_t* ctx = emdns_ctx_new(0);
+    if (file == 0 || ctx == 0) {
+        fprintf(stderr, "Error: could not open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    masterfile_parse(ctx, file);
+    fclose(file);
+
+    zone_queries_t zone = {0, 0, 0};
+    emdns_foreach_record(ctx, _collect, &zone);
+    if (zone.count == 0) {
+        fprintf(stderr, "Error: no records in %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char request[512];
+    char response[4096];
+    uint16_t answer_len;
+    uint64_t answers = 0;
+    uint32_t passes = (iterations / zone.count > 0 ? iterations / zone.count : 1);
+    uint64_t start = _now();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        for (uint32_t i = 0; i < zone.count; i++) {
+            uint16_t request_len = _query(request, zone.queries[i].name, zone.queries[i].type);
+            emdns_resolve_raw(ctx, request, request_len, response, sizeof (response), &answer_len);
+            answers += (response[6] << 8) | (uint8_t) response[7];
+        }
+    }
+    uint64_t elapsed = _now() - start;
+    printf("%-10s %8.1f %8s %10.1f\n", "zone", (double) answers / passes / zone.count, "-",
+        (double) elapsed / passes / zone.count);
+    free(zone.queries);
+    emdns_ctx_free(ctx);
+}
+
+int main(int argc, char** argv) {
+    uint32_t iterations = (argc > 1 ? atoi(argv[1]) : 1000000);
+    emdns_ctx_t* ctx = emdns_ctx_new(0);
+    if (ctx == 0) {
+        return EXIT_FAILURE;
+    }
+    _add(ctx, "bench.com", RecordSOA, "ns1.bench.com hostmaster.bench.com 2024010101 3600 900 604800 300");
+    _add(ctx, "bench.com", RecordNS, "ns1.bench.com");
+    _add(ctx, "bench.com", RecordNS, "ns2.bench.com");
+    _add(ctx, "bench.com", RecordMX, "10 mail.bench.com");
+    _add(ctx, "bench.com", RecordMX, "20 mail2.bench.com");
+    _add(ctx, "bench.com", RecordTXT, "v=spf1 mx a:mail.bench.com -all");
+    _add(ctx, "a.bench.com", RecordA, "192.0.2.1");
+    _add(ctx, "target.bench.com", RecordA, "192.0.2.2");
+    _add(ctx, "alias.bench.com", RecordCNAME, "target.bench.com");
+    _add(ctx, "4.3.2.1.in-addr.arpa", RecordPTR, "a.bench.com");
+    for (int i = 0; i < 8; i++) {
+        char ip[24];
+        snprintf(ip, sizeof (ip), "198.51.100.%d", i + 1);
+        _add(ctx, "rrset.bench.com", RecordA, ip);
+    }
+
+    char request[512];
+    char response[4096];
+    char name[256];
+    printf("%-10s %8s %8s %10s\n", "query", "answers", "bytes", "ns/query");
+    for (size_t q = 0; q < sizeof (queries) / sizeof (queries[0]); q++) {
+        _encode_name(queries[q].name, name);
+        uint16_t request_len = _query(request, name, queries[q].type);
+        uint16_t answer_len = 0;
+        emdns_resolve_raw(ctx, request, request_len, response, sizeof (response), &answer_len);
+        uint64_t start = _now();
+        for (uint32_t i = 0; i < iterations; i++) {
+            emdns_resolve_raw(ctx, request, request_len, response, sizeof (response), &answer_len);
+            __asm__ volatile("" : : "r"(response) : "memory");
+        }
+        uint64_t elapsed = _now() - start;
+        printf("%-10s %8d %8d %10.1f\n", queries[q].label, (response[6] << 8) | (uint8_t) response[7],
+            answer_len, (double) elapsed / iterations);
+    }
+    emdns_ctx_free(ctx);
+
+    if (argc > 2) {
+        _bench_zone(argv[2], iterations);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,22 @@
+# Join the output of two runs of bench_encode by query, e.g.
+#   awk -f bench/compare.awk before.txt after.txt
+# The query is the first column, padded to 10 characters.
+BEGIN {
+    printf "%-10s %10s %10s %8s\n", "query", "before", "after", "change"
+}
+FNR == 1 {
+    next
+}
+NR == FNR {
+    before[substr($0, 1, 10)] = $NF
+    next
+}
+{
+    query = substr($0, 1, 10)
+    if (query in before && before[query] > 0) {
+        printf "%-10s %10.1f %10.1f %+7.1f%%\n", query, before[query], $NF, ($NF - before[query]) * 100 / before[query]
+    }
+    else {
+        printf "%-10s %10s %10.1f %8s\n", query, "-", $NF, "-"
+    }
+}
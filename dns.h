@@ -26,7 +26,9 @@ typedef enum {
     RecordSOA = 6,
     RecordPTR = 12,
     RecordMX = 15,
-    RecordTXT = 16
+    RecordTXT = 16,
+    RecordAXFR = 252,   ///< for requests only
+    RecordANY = 255     ///< for requests only
 } dns_record_t;
 
 /**
@@ -37,6 +39,7 @@ typedef enum {
     ClassCS = 2,    ///< CSNET (obsolete)
     ClassCH = 3,    ///< Chaos (obsolete)
     ClassHS = 4,    ///< Hesoid (obsolete)
+    ClassNONE = 254, ///< for dynamic updates only
     ClassANY = 255  ///< for requests only
 } dns_class_t;
 
@@ -52,12 +55,19 @@ typedef enum {
     FlagOpQuery = 0x0000,
     FlagOpInvQuery = 0x0800,
     FlagOpStatus = 0x1000,
+    FlagOpUpdate = 0x2800,
+    FlagOpMask = 0x7800,
     FlagNoError = 0x0000,
     FlagErrFormat = 0x0001,
     FlagErrServerFail = 0x0002,
     FlagErrName = 0x0003,
     FlagErrNotImpl = 0x0004,
-    FlagErrRefused = 0x0005
+    FlagErrRefused = 0x0005,
+    FlagErrYXDomain = 0x0006,
+    FlagErrYXRRSet = 0x0007,
+    FlagErrNXRRSet = 0x0008,
+    FlagErrNotAuth = 0x0009,
+    FlagErrNotZone = 0x000A
 } dns_flags_t;
 
 #endif /* DNS_H */
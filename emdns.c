@@ -1,167 +1,772 @@
 #include "stdlib.h"
 #include "string.h"
 #include "emdns.h"
+#include "names.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "arpa/inet.h"
+#include "stdatomic.h"
+#include "stddef.h"
 
+// wire data is not aligned, fields are copied bytewise, which compilers turn
+// into single loads and stores where the CPU allows unaligned access
 #define PACK8(p, val)    ((*(uint8_t*)p) = (val));  p++;
-#define PACK16(p, val)   ((*(uint16_t*)p) = (val)); p+=2;
-#define PACK32(p, val)   ((*(uint32_t*)p) = (val)); p+=4;
+#define PACK16(p, val)   { uint16_t v_ = (val); memcpy((p), &v_, 2); } p+=2;
+#define PACK32(p, val)   { uint32_t v_ = (val); memcpy((p), &v_, 4); } p+=4;
 #define UNPACK8(p, val)  val =  (*((uint8_t*)(p))); p++;
-#define UNPACK16(p, val) val = (*((uint16_t*)(p))); p+=2;
-#define UNPACK32(p, val) val = (*((uint32_t*)(p))); p+=4;
-#define UNPACK8(p, val)  val =  (*((uint8_t*)(p))); p++;
-#define UNPACK16_N2H(p, val) val = ntohs(*((uint16_t*)(p))); p+=2;
-#define UNPACK32_N2H(p, val) val = ntohl(*((uint32_t*)(p))); p+=4;
+#define UNPACK16(p, val) { uint16_t v_; memcpy(&v_, (p), 2); val = v_; } p+=2;
+#define UNPACK32(p, val) { uint32_t v_; memcpy(&v_, (p), 4); val = v_; } p+=4;
+#define UNPACK16_N2H(p, val) { uint16_t v_; memcpy(&v_, (p), 2); val = ntohs(v_); } p+=2;
+#define UNPACK32_N2H(p, val) { uint32_t v_; memcpy(&v_, (p), 4); val = ntohl(v_); } p+=4;
 #define MOVE(p, count) p+=(count);
 
+// offsets of the header fields, see _header_get
+#define HEADER_FLAGS   offsetof(dns_header_t, flags)
+#define HEADER_QDCOUNT offsetof(dns_header_t, qdcount)
+#define HEADER_ANCOUNT offsetof(dns_header_t, ancount)
+#define HEADER_NSCOUNT offsetof(dns_header_t, nscount)
+#define HEADER_ARCOUNT offsetof(dns_header_t, arcount)
+
+// type, class, TTL and rdata length of a resource record
+#define RR_HEADER_LEN 10
+
+#define EMDNS_RDATA_MAX 1024
+#define EMDNS_ANY_MAX 4096
+// CNAME records followed for a query, to stop at loops
+#define EMDNS_ALIAS_MAX 8
+
+/**
+ * A stored record. The domain is an interned name, and so are the names in the
+ * rdata of CNAME, NS, PTR, MX and SOA records, which are stored as 32 bit
+ * references in place of the names. Other rdata is stored in wire format.
+ * Type, class, TTL and the length of the rdata in wire format are only kept
+ * in the RR header, see the accessors below.
+ */
 typedef struct emdns_record_t {
     struct emdns_record_t* next;
+    uint32_t domain;
+    uint16_t length;        ///< length of the stored rdata
+    char wire[];            ///< RR header in wire format, then the stored rdata
+} emdns_record_t;
+
+static inline uint16_t _record_type(emdns_record_t* record) {
+    char* p = record->wire;
+    uint16_t type;
+    UNPACK16_N2H(p, type);
+    return type;
+}
+
+static inline uint16_t _record_class(emdns_record_t* record) {
+    char* p = record->wire + 2;
+    uint16_t class;
+    UNPACK16_N2H(p, class);
+    return class;
+}
+
+static inline uint32_t _record_ttl(emdns_record_t* record) {
+    char* p = record->wire + 4;
+    uint32_t ttl;
+    UNPACK32_N2H(p, ttl);
+    return ttl;
+}
+
+static inline uint16_t _record_rdata_length(emdns_record_t* record) {
+    char* p = record->wire + 8;
+    uint16_t length;
+    UNPACK16_N2H(p, length);
+    return length;
+}
+
+/**
+ * @return the stored rdata, behind the header
+ */
+static inline char* _record_rdata(emdns_record_t* record) {
+    return record->wire + RR_HEADER_LEN;
+}
+
+/**
+ * Read a field of a message header. Messages need not be aligned, so the
+ * header is not accessed as dns_header_t.
+ */
+static inline uint16_t _header_get(char* message, size_t field) {
+    char* p = message + field;
+    uint16_t value;
+    UNPACK16_N2H(p, value);
+    return value;
+}
+
+static inline void _header_set(char* message, size_t field, uint16_t value) {
+    char* p = message + field;
+    PACK16(p, htons(value));
+}
+
+/**
+ * Template of records created by emdns_add_generate. The domain template is
+ * split into prefix, $ and suffix, so that queried domains can be matched.
+ */
+typedef struct emdns_generate_t {
+    struct emdns_generate_t* next;
+    struct emdns_generate_t* next_in_bucket;
+    uint32_t start;
+    uint32_t stop;
+    uint32_t step;
+    uint32_t ttl;
     dns_record_t record_type;
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
     dns_class_t record_class;
-#endif    
+    char* lhs;
+    char* rhs;
+    char* suffix;
+    uint32_t hash;
+    int32_t offset;
+    uint8_t prefix_len;
+    uint8_t suffix_len;
+    uint8_t width;
+    char base;
+} emdns_generate_t;
+
+/**
+ * State of matching a queried domain to the templates. All suffixes of the
+ * domain are looked up in the index, starting with the shortest one.
+ */
+typedef struct {
     char* domain;
-    char* response;
-    uint32_t ttl;
-    uint16_t length;
-} emdns_record_t;
+    char name[256];
+    uint16_t len;
+    uint16_t pos;
+    uint32_t hash;
+    emdns_generate_t* generate;
+} generate_lookup_t;
+
+/**
+ * An RRset within the encoded records of a name.
+ */
+typedef struct {
+    uint16_t record_type;
+    uint32_t count;
+    uint32_t offset;            ///< offset of the first record in the encoded records
+    uint32_t length;
+    _Atomic uint32_t rotation;  ///< answers given, to choose the first record
+} emdns_rrset_t;
 
+/**
+ * Records of a name and class encoded for answers, grouped into RRsets in the
+ * order in which their types first occur in the records. Every record is in
+ * wire format with a compression pointer as its owner name, which is replaced
+ * by the name when the records are copied to an answer. The encoded records
+ * are updated together with the records, so answers only read them.
+ */
+typedef struct emdns_encoded_t {
+    struct emdns_encoded_t* next;
+    uint32_t name;
+    uint16_t record_class;
+    uint16_t rrset_count;
+    uint16_t smallest;      ///< RRset of a minimal answer to ANY (RFC 8482)
+    uint32_t length;        ///< length of all records
+    uint32_t count;
+    emdns_rrset_t rrsets[]; ///< followed by the records
+} emdns_encoded_t;
 
-static emdns_record_t* records;
+struct emdns_ctx_t {
+    uint32_t options;
+    emdns_record_t* records;
+    emdns_update_hook_t update_hook;
+    emdns_generate_t* generates;
+    emdns_generate_t** generates_tail;
+    emdns_generate_t** generate_index;
+    uint32_t generate_buckets;
+    uint32_t generate_count;
+    emdns_encoded_t** encoded_index;
+    uint32_t encoded_buckets;
+    uint32_t encoded_count;
+    names_t names;
+};
 
 static char* _to_dns_string(char* domain);
-static uint32_t _to_ip_value(char* ip);
-static void pack_resource_record(emdns_record_t* record, char** response_buffer);
+static int _to_dns_buffer(char* domain, char* dns_string);
+static int _to_ip_value(char* ip, uint32_t* ip_value);
+static int pack_resource_record(emdns_change_t* record, char** response_buffer, char* response_end);
+static int _pack_record(emdns_ctx_t* ctx, emdns_record_t* record, char* owner, uint16_t owner_len, char** response_buffer, char* response_end);
+static void _free_record(emdns_ctx_t* ctx, emdns_record_t* record);
+static int _store_rdata(emdns_ctx_t* ctx, dns_record_t record_type, char* rdata, uint16_t length, char* stored, char intern);
+static void _release_rdata(emdns_ctx_t* ctx, dns_record_t record_type, char* stored);
+static emdns_change_t* _record_change(emdns_ctx_t* ctx, emdns_record_t* record, emdns_change_t* change, char* rdata);
+static int _encode_rdata(dns_record_t record_type, char* response, char* rdata);
+static int _add_record_raw(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class, char* rdata, uint16_t length, uint32_t ttl);
+static int _remove_records(emdns_ctx_t* ctx, emdns_change_t* change, char report);
+static uint16_t _process_update(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len);
+static char _prerequisite_contains(char* request_buffer, uint16_t request_len, uint16_t pos, uint16_t prcount, emdns_change_t* record);
+static char _prerequisite_rrsets(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len, uint16_t pos, uint16_t prcount, dns_class_t zone_class);
+static char _serial_newer(emdns_change_t* soa, emdns_change_t* old);
+static int _read_question(char* request_buffer, uint16_t request_len, char** domain, uint16_t* type, uint16_t* class);
+static char _in_zone(char* domain, char* zone);
+static void _free_generate(emdns_generate_t* generate);
+static int _generate_record(emdns_generate_t* generate, uint32_t value, char* name, char* rdata);
+static int _generate_parse_lhs(emdns_generate_t* generate);
+static int _generate_index_add(emdns_ctx_t* ctx, emdns_generate_t* generate);
+static void _generate_lookup_init(emdns_ctx_t* ctx, generate_lookup_t* lookup, char* domain);
+static int _encoded_add(emdns_ctx_t* ctx, emdns_record_t* record);
+static void _encoded_update(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class);
+static emdns_encoded_t* _encoded_find(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class);
+static char* _encoded_data(emdns_encoded_t* encoded);
+static emdns_rrset_t* _rrset_find(emdns_encoded_t* encoded, dns_record_t record_type);
+static emdns_rrset_t* _encoded_rrset(emdns_ctx_t* ctx, uint32_t name, dns_record_t record_type, dns_class_t record_class, char** data);
+static int _rrset_copy(char* data, uint32_t start, uint32_t length, char* domain, char* response, char** response_buffer, char* response_end);
+static uint16_t _rrset_rotate(emdns_ctx_t* ctx, emdns_rrset_t* rrset, char* data);
+static char _resolve_any(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class, char* domain, char* response, char** response_buffer, char* response_end, uint16_t* ancount);
+static char _resolve_any_generated(emdns_ctx_t* ctx, dns_class_t record_class, char* domain, char** response_buffer, char* response_end, uint16_t* ancount);
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
-static emdns_record_t* _find_record(char* domain, dns_record_t record_type, dns_class_t record_class, emdns_record_t* start);
-#else
-static emdns_record_t* _find_record(char* domain, dns_record_t record_type, emdns_record_t* start);
-#endif
+static emdns_record_t* _find_record(emdns_ctx_t* ctx, uint32_t domain, dns_record_t record_type, dns_class_t record_class, emdns_record_t* start);
+static emdns_change_t* _find_generated(emdns_ctx_t* ctx, generate_lookup_t* lookup, dns_record_t record_type, dns_class_t record_class, emdns_change_t* record, char* rdata);
+
+emdns_ctx_t* emdns_ctx_new(uint32_t options) {
+    emdns_ctx_t* ctx = calloc(1, sizeof (emdns_ctx_t));
+    if (ctx == 0) {
+        return 0;
+    }
+    ctx->options = options;
+    ctx->generates_tail = &ctx->generates;
+    names_init(&ctx->names);
+    return ctx;
+}
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
+void emdns_ctx_free(emdns_ctx_t* ctx) {
+    while (ctx->records != 0) {
+        emdns_record_t* next = ctx->records->next;
+        // the names are freed all at once
+        free(ctx->records);
+        ctx->records = next;
+    }
+    while (ctx->generates != 0) {
+        emdns_generate_t* next = ctx->generates->next;
+        _free_generate(ctx->generates);
+        ctx->generates = next;
+    }
+    free(ctx->generate_index);
+    for (uint32_t i = 0; i < ctx->encoded_buckets; i++) {
+        while (ctx->encoded_index[i] != 0) {
+            emdns_encoded_t* next = ctx->encoded_index[i]->next;
+            free(ctx->encoded_index[i]);
+            ctx->encoded_index[i] = next;
+        }
+    }
+    free(ctx->encoded_index);
+    names_free(&ctx->names);
+    free(ctx);
+}
 
-int emdns_add_record(char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl) {
-#else
+/**
+ * Check if records of a class can be stored in a context.
+ */
+static char _class_supported(emdns_ctx_t* ctx, dns_class_t record_class) {
+    return record_class == ClassIN || (ctx->options & OptionAllClasses);
+}
 
-int emdns_add_record(char* domain, dns_record_t record_type, char* response, uint32_t ttl) {
-#endif    
+int emdns_add_record(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl) {
 
 #ifdef EMDNS_ENABLE_LOGGING    
     printf("Added record.\n");
 #endif
 
-    emdns_record_t* entry = malloc(sizeof (emdns_record_t));
-    if (entry != 0) {
-        entry->domain = _to_dns_string(domain);
-        entry->record_type = record_type;
-        entry->ttl = ttl;
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
-        entry->record_class = record_class;
-#endif        
-
-        switch (record_type) {
-            case RecordA:
-                entry->length = sizeof (uint32_t);
-                entry->response = malloc(entry->length);
-                *((uint32_t*) (entry->response)) = htonl(_to_ip_value(response));
-                break;
+    char rdata[EMDNS_RDATA_MAX];
+    int length = _encode_rdata(record_type, response, rdata);
+    if (length < 0) {
+        return -1;
+    }
 
-            case RecordCNAME:
-            case RecordNS:
-            case RecordPTR:
-                entry->response = _to_dns_string(response);
-                entry->length = strlen(entry->response) + 1;
-                break;
+    char* dns_string = _to_dns_string(domain);
+    if (dns_string == 0) {
+        return -1;
+    }
+    int res = _add_record_raw(ctx, dns_string, record_type, record_class, rdata, length, ttl);
+    free(dns_string);
+    return res;
+}
+
+/**
+ * Convert the response of a record from text to the format the records are
+ * stored in (uncompressed wire format).
+ * 
+ * @return length of the rdata, -1 if the type is not supported or the response
+ *         is invalid
+ */
+static int _encode_rdata(dns_record_t record_type, char* response, char* rdata) {
+    int length = -1;
 
-            case RecordMX:
-                entry->length = sizeof (uint16_t) + strlen(response) + 2;
-                uint16_t preference = 0;
-                entry->response = malloc(entry->length);
-                int res = sscanf(response, "%hd %s", &preference, (entry->response + 2));
+    switch (record_type) {
+        case RecordA:
+        {
+            uint32_t ip_value;
+            if (_to_ip_value(response, &ip_value) != 0) {
+                return -1;
+            }
+            length = sizeof (uint32_t);
+            PACK32(rdata, htonl(ip_value));
+        }
+            break;
+
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+        {
+            char* dns_str = _to_dns_string(response);
+            if (dns_str == 0) {
+                return -1;
+            }
+            length = strlen(dns_str) + 1;
+            memcpy(rdata, dns_str, length);
+            free(dns_str);
+        }
+            break;
+
+        case RecordMX:
+        {
+            uint16_t preference = 0;
+            char server[256];
+            if (sscanf(response, "%hu %255s", &preference, server) != 2) {
+                return -1;
+            }
+            char* dns_str = _to_dns_string(server);
+            if (dns_str == 0) {
+                return -1;
+            }
 
-                *((uint16_t*) entry->response) = htons(preference);
-                char* dns_str = _to_dns_string(entry->response + 2);
-                strcpy(entry->response + 2, dns_str);
+            PACK16(rdata, htons(preference));
+            strcpy(rdata, dns_str);
+
+            length = sizeof (uint16_t) + strlen(dns_str) + 1;
+            free(dns_str);
+        }
+            break;
 
-                entry->length -= (strlen(response) - strlen(dns_str) + 1);
-                free(dns_str);
+        case RecordSOA:
+        {
+            char server[256];
+            char mail[256];
+            uint32_t serial, refresh, retry, expire, minimum;
 
-                break;
+            if (sscanf(response, "%255s %255s %u %u %u %u %u", server, mail, &serial, &refresh, &retry, &expire, &minimum) != 7) {
+                return -1;
+            }
 
-            case RecordSOA:
-            {
-                char* server = malloc(256);
-                char* mail = malloc(256);
-                uint32_t serial, refresh, retry, expire, minimum;
-
-                int res = sscanf(response, "%s %s %d %d %d %d %d", server, mail, &serial, &refresh, &retry, &expire, &minimum);
-                entry->length = strlen(server) + 2 + strlen(mail) + 2 + (5 * sizeof (uint32_t));
-                entry->response = malloc(entry->length);
-
-                char* server_dns = _to_dns_string(server);
-                char* mail_dns = _to_dns_string(mail);
-                strcpy(entry->response, server_dns);
-                strcpy(entry->response + strlen(server_dns) + 1, mail_dns);
-                uint8_t* p = entry->response + strlen(server_dns) + strlen(mail_dns) + 2;
-                *((uint32_t*) (p + 0)) = htonl(serial);
-                *((uint32_t*) (p + 4)) = htonl(refresh);
-                *((uint32_t*) (p + 8)) = htonl(retry);
-                *((uint32_t*) (p + 12)) = htonl(expire);
-                *((uint32_t*) (p + 16)) = htonl(minimum);
-
-                entry->length = strlen(server_dns) + 1 + strlen(mail_dns) + 1 + (5 * sizeof (uint32_t));
-
-                free(server);
-                free(mail);
+            char* server_dns = _to_dns_string(server);
+            char* mail_dns = _to_dns_string(mail);
+            if (server_dns == 0 || mail_dns == 0) {
                 free(server_dns);
                 free(mail_dns);
+                return -1;
             }
-                break;
+            strcpy(rdata, server_dns);
+            strcpy(rdata + strlen(server_dns) + 1, mail_dns);
+            char* p = rdata + strlen(server_dns) + strlen(mail_dns) + 2;
+            PACK32(p, htonl(serial));
+            PACK32(p, htonl(refresh));
+            PACK32(p, htonl(retry));
+            PACK32(p, htonl(expire));
+            PACK32(p, htonl(minimum));
 
-            case RecordTXT:
-                entry->length = strlen(response) + 1;
-                entry->response = malloc(entry->length);
-                *((uint8_t*) entry->response) = strlen(response);
-                memcpy(entry->response + 1, response, entry->length);
-                break;
+            length = strlen(server_dns) + 1 + strlen(mail_dns) + 1 + (5 * sizeof (uint32_t));
+
+            free(server_dns);
+            free(mail_dns);
+        }
+            break;
+
+        case RecordTXT:
+            // a single character-string
+            if (strlen(response) > 255) {
+                return -1;
+            }
+            length = strlen(response) + 1;
+            *((uint8_t*) rdata) = strlen(response);
+            memcpy(rdata + 1, response, length - 1);
+            break;
+
+        default:
+            // not supported
+            break;
+    }
+
+    return length;
+}
+
+
+int emdns_add_generate(emdns_ctx_t* ctx, uint32_t start, uint32_t stop, uint32_t step, char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl) {
+    if (step == 0 || stop < start || !_class_supported(ctx, record_class)) {
+        return -1;
+    }
+
+    emdns_generate_t* generate = malloc(sizeof (emdns_generate_t));
+    if (generate == 0) {
+        return -1;
+    }
+    generate->start = start;
+    generate->stop = stop;
+    generate->step = step;
+    generate->ttl = ttl;
+    generate->record_type = record_type;
+    generate->record_class = record_class;
+    generate->lhs = malloc(strlen(domain) + 1);
+    generate->rhs = malloc(strlen(response) + 1);
+    if (generate->lhs == 0 || generate->rhs == 0) {
+        _free_generate(generate);
+        return -1;
+    }
+    strcpy(generate->lhs, domain);
+    strcpy(generate->rhs, response);
+
+    // test the templates on the first and the last value. The width of a
+    // modifier grows with the distance of its value from 0, so its longest
+    // expansion is at one end of the range, also with a negative offset.
+    // Every expansion is bounds checked, values in between which do not fit
+    // (e.g. with modifiers of different offsets) are skipped when answering
+    char name[256];
+    char rdata[EMDNS_RDATA_MAX];
+    if (_generate_record(generate, start, name, rdata) < 0 ||
+        _generate_record(generate, stop - (stop - start) % step, name, rdata) < 0) {
+        _free_generate(generate);
+        return -1;
+    }
+
+    if (_generate_parse_lhs(generate) != 0) {
+        // the domain can not be matched, create all the records
+        int res = 0;
+        for (uint64_t i = start; i <= stop && res == 0; i += step) {
+            int length = _generate_record(generate, i, name, rdata);
+            res = (length < 0 ? -1 : _add_record_raw(ctx, name, record_type, record_class, rdata, length, ttl));
+        }
+        _free_generate(generate);
+        return res;
+    }
+
+    if (_generate_index_add(ctx, generate) != 0) {
+        _free_generate(generate);
+        return -1;
+    }
+
+    // keep the order in which the templates were added
+    generate->next = 0;
+    *ctx->generates_tail = generate;
+    ctx->generates_tail = &generate->next;
+    return 0;
+}
+
+static void _free_generate(emdns_generate_t* generate) {
+    free(generate->lhs);
+    free(generate->rhs);
+    free(generate);
+}
+
+/**
+ * Parse a ${offset,width,base} modifier following $.
+ * 
+ * @return pointer after the modifier, 0 if it is invalid
+ */
+static char* _generate_parse_modifier(char* p, int32_t* offset, uint8_t* width, char* base) {
+    *offset = 0;
+    *width = 0;
+    *base = 'd';
+    if (*p != '{') {
+        return p;
+    }
+
+    char* end;
+    *offset = strtol(p + 1, &end, 10);
+    if (*end == ',') {
+        long w = strtol(end + 1, &end, 10);
+        if (w < 0 || w > 10) {
+            return 0;
+        }
+        *width = w;
+        if (*end == ',') {
+            *base = end[1];
+            end += (end[1] != '\0' ? 2 : 1);
+        }
+    }
+    if (*end != '}' || (*base != 'd' && *base != 'o' && *base != 'x' && *base != 'X')) {
+        return 0;
+    }
+    return end + 1;
+}
+
+/**
+ * Format a value the way a ${offset,width,base} modifier does.
+ *
+ * @return length of the formatted value
+ */
+static int _generate_format(int64_t value, uint8_t width, char base, char* out, size_t size) {
+    if (value < 0) {
+        return snprintf(out, size, "%0*lld", width, (long long) value);
+    }
+    else if (base == 'o') {
+        return snprintf(out, size, "%0*llo", width, (unsigned long long) value);
+    }
+    else if (base == 'x') {
+        return snprintf(out, size, "%0*llx", width, (unsigned long long) value);
+    }
+    else if (base == 'X') {
+        return snprintf(out, size, "%0*llX", width, (unsigned long long) value);
+    }
+    else {
+        return snprintf(out, size, "%0*lld", width, (long long) value);
+    }
+}
+
+/**
+ * Replace all $ in a template with the value of the iterator.
+ * 
+ * @return 0 = success, -1 = invalid template or the result is too long
+ */
+static int _generate_expand(char* template, uint32_t value, char* out, uint16_t max) {
+    char number[24];
+    uint16_t len = 0;
+
+    while (*template != '\0') {
+        char* part = template;
+        uint16_t part_len = 1;
+        if (*template == '\\' && template[1] == '$') {
+            part++;
+            template += 2;
+        }
+        else if (*template == '$') {
+            int32_t offset;
+            uint8_t width;
+            char base;
+            template = _generate_parse_modifier(template + 1, &offset, &width, &base);
+            if (template == 0) {
+                return -1;
+            }
+            part = number;
+            part_len = _generate_format((int64_t) value + offset, width, base, number, sizeof (number));
+        }
+        else {
+            template++;
+        }
+
+        if (len + part_len >= max) {
+            return -1;
+        }
+        memcpy(out + len, part, part_len);
+        len += part_len;
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+/**
+ * Create the record of a template for a value of the iterator.
+ * 
+ * @param name domain of the record in DNS format
+ * @param rdata rdata of the record
+ * @return length of rdata, -1 on error
+ */
+static int _generate_record(emdns_generate_t* generate, uint32_t value, char* name, char* rdata) {
+    char text[256];
+    if (_generate_expand(generate->lhs, value, text, sizeof (text) - 1) != 0) {
+        return -1;
+    }
+    if (_to_dns_buffer(text, name) != 0) {
+        return -1;
+    }
+    if (_generate_expand(generate->rhs, value, text, sizeof (text)) != 0) {
+        return -1;
+    }
+    return _encode_rdata(generate->record_type, text, rdata);
+}
+
+/**
+ * Split the domain template into the prefix, a single $ and the suffix, which
+ * is needed to match queried domains.
+ * 
+ * @return 0 = success, -1 = the template can not be matched
+ */
+static int _generate_parse_lhs(emdns_generate_t* generate) {
+    char* lhs = generate->lhs;
+    char* dollar = strchr(lhs, '$');
+    if (dollar == 0 || strchr(lhs, '\\') != 0) {
+        return -1;
+    }
+
+    generate->prefix_len = dollar - lhs;
+    generate->suffix = _generate_parse_modifier(dollar + 1, &generate->offset, &generate->width, &generate->base);
+    if (generate->suffix == 0 || strchr(generate->suffix, '$') != 0) {
+        return -1;
+    }
+
+    // queried domains do not end with a dot
+    generate->suffix_len = strlen(generate->suffix);
+    if (generate->suffix_len > 0 && generate->suffix[generate->suffix_len - 1] == '.') {
+        generate->suffix_len--;
+    }
+    return 0;
+}
+
+static uint32_t _generate_hash_step(uint32_t hash, char c) {
+    return hash * 31 + (uint8_t) c;
+}
+
+/**
+ * Add a template to the index, which is a hash table of the suffixes.
+ */
+static int _generate_index_add(emdns_ctx_t* ctx, emdns_generate_t* generate) {
+    if (ctx->generate_count >= ctx->generate_buckets) {
+        // grow the table
+        uint32_t buckets = (ctx->generate_buckets == 0 ? 16 : ctx->generate_buckets * 2);
+        emdns_generate_t** index = calloc(buckets, sizeof (emdns_generate_t*));
+        if (index == 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < ctx->generate_buckets; i++) {
+            emdns_generate_t* item = ctx->generate_index[i];
+            while (item != 0) {
+                emdns_generate_t* next = item->next_in_bucket;
+                item->next_in_bucket = index[item->hash & (buckets - 1)];
+                index[item->hash & (buckets - 1)] = item;
+                item = next;
+            }
         }
+        free(ctx->generate_index);
+        ctx->generate_index = index;
+        ctx->generate_buckets = buckets;
+    }
+
+    // the hash is computed from the end, so that all suffixes of a queried
+    // domain can be hashed in one pass
+    generate->hash = 0;
+    for (int16_t i = generate->suffix_len - 1; i >= 0; i--) {
+        generate->hash = _generate_hash_step(generate->hash, generate->suffix[i]);
+    }
+    uint32_t bucket = generate->hash & (ctx->generate_buckets - 1);
+    generate->next_in_bucket = ctx->generate_index[bucket];
+    ctx->generate_index[bucket] = generate;
+    ctx->generate_count++;
+    return 0;
+}
+
+/**
+ * Check if a domain matches a template, and find the value of the iterator.
+ */
+static char _generate_match(emdns_generate_t* generate, char* name, uint16_t suffix_pos, uint32_t* value) {
+    char number[24];
+    char formatted[24];
+    uint16_t number_len = suffix_pos - generate->prefix_len;
+
+    if (suffix_pos <= generate->prefix_len || number_len > 22 ||
+        memcmp(name + suffix_pos, generate->suffix, generate->suffix_len) != 0 ||
+        memcmp(name, generate->lhs, generate->prefix_len) != 0) {
+        return 0;
+    }
+    memcpy(number, name + generate->prefix_len, number_len);
+    number[number_len] = '\0';
+
+    // the number has to be formatted exactly as the template would do it
+    int radix = (generate->base == 'o' ? 8 : (generate->base == 'd' ? 10 : 16));
+    char* end;
+    long long parsed = strtoll(number, &end, radix);
+    if (*end != '\0') {
+        return 0;
+    }
+    if (_generate_format(parsed, generate->width, generate->base, formatted, sizeof (formatted)) != number_len ||
+        strcmp(number, formatted) != 0) {
+        return 0;
+    }
 
-        entry->next = records;
-        records = entry;
+    long long i = parsed - generate->offset;
+    if (i < generate->start || i > generate->stop || (i - generate->start) % generate->step != 0) {
         return 0;
     }
+    *value = i;
+    return 1;
+}
+
+static void _generate_lookup_init(emdns_ctx_t* ctx, generate_lookup_t* lookup, char* domain) {
+    char* p = lookup->name;
+    lookup->domain = domain;
+    while (*domain != '\0') {
+        uint8_t len = *domain;
+        if (p != lookup->name) {
+            *(p++) = '.';
+        }
+        memcpy(p, domain + 1, len);
+        MOVE(p, len);
+        MOVE(domain, len + 1);
+    }
+    *p = '\0';
 
-    return -1;
+    lookup->len = p - lookup->name;
+    lookup->pos = lookup->len;
+    lookup->hash = 0;
+    lookup->generate = (ctx->generate_count > 0 ? ctx->generate_index[0] : 0);
 }
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
+/**
+ * Find the next template matching the domain of a lookup, and synthesize the
+ * record.
+ * 
+ * @param record_type type of the templates, RecordANY for templates of all types
+ * @param record record will be prepared here, its domain is the queried one
+ * @param rdata buffer for the rdata of the record
+ * @return the record, 0 if there are no more matching templates
+ */
+static emdns_change_t* _find_generated(emdns_ctx_t* ctx, generate_lookup_t* lookup, dns_record_t record_type, dns_class_t record_class, emdns_change_t* record, char* rdata) {
+    char name[256];
+    uint32_t value;
 
-int emdns_remove_record(char* domain, dns_record_t record_type, dns_class_t record_class) {
-#else
+    while (1) {
+        while (lookup->generate != 0) {
+            emdns_generate_t* generate = lookup->generate;
+            lookup->generate = generate->next_in_bucket;
+
+            if ((record_type == RecordANY || generate->record_type == record_type) &&
+                generate->record_class == record_class &&
+                generate->suffix_len == lookup->len - lookup->pos &&
+                _generate_match(generate, lookup->name, lookup->pos, &value)) {
+                int length = _generate_record(generate, value, name, rdata);
+                if (length < 0) {
+                    continue;
+                }
+                record->op = ChangeAdd;
+                record->domain = lookup->domain;
+                record->record_type = generate->record_type;
+                record->record_class = record_class;
+                record->ttl = generate->ttl;
+                record->rdata = rdata;
+                record->length = length;
+                return record;
+            }
+        }
+
+        // continue with a longer suffix, at least one character is the number
+        if (lookup->pos <= 1) {
+            return 0;
+        }
+        lookup->pos--;
+        lookup->hash = _generate_hash_step(lookup->hash, lookup->name[lookup->pos]);
+        lookup->generate = ctx->generate_index[lookup->hash & (ctx->generate_buckets - 1)];
+    }
+}
 
-int emdns_remove_record(char* domain, dns_record_t record_type) {
-#endif    
+
+int emdns_remove_record(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class) {
     char* dns_string = _to_dns_string(domain);
-    emdns_record_t* ptr_record = records;
+    if (dns_string == 0) {
+        return 0;
+    }
+    uint32_t name = names_lookup(&ctx->names, dns_string);
+    emdns_record_t* ptr_record = (name != NAME_NONE ? ctx->records : 0);
     emdns_record_t* ptr_prev = 0;
     uint8_t records_removed = 0;
     while (ptr_record != 0) {
-        if (ptr_record->record_type == record_type &&
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
-            ptr_record->record_class == record_class &&
-#endif                
-            strcmp(ptr_record->domain, dns_string) == 0) {
-            if (ptr_record == records) {
-                records = ptr_record->next;
+        if (_record_type(ptr_record) == record_type &&
+            _record_class(ptr_record) == record_class &&
+            ptr_record->domain == name) {
+            if (ptr_record == ctx->records) {
+                ctx->records = ptr_record->next;
             }
             else {
                 ptr_prev->next = ptr_record->next;
             }
             emdns_record_t* next = ptr_record->next;
-            free(ptr_record);
+            _free_record(ctx, ptr_record);
             records_removed++;
             ptr_record = next;
             continue;
@@ -169,163 +774,1887 @@ int emdns_remove_record(char* domain, dns_record_t record_type) {
         ptr_prev = ptr_record;
         ptr_record = ptr_record->next;
     }
+    if (records_removed > 0) {
+        _encoded_update(ctx, name, record_class);
+    }
     free(dns_string);
     return records_removed;
 }
 
-static char* _to_dns_string(char* domain) {
-    char* dns_string = malloc(2 + strlen(domain));
-    char* p_dns_string = dns_string + 1;
-    char* p_length_byte = dns_string;
-    *p_length_byte = 0;
-
-    while (*domain != '\0') {
-        if (*domain != '.') {
-            *p_dns_string = *domain;
-            (*p_length_byte)++;
-        }
-        else {
-            p_length_byte = p_dns_string;
-            *p_length_byte = 0;
+int emdns_apply_change(emdns_ctx_t* ctx, emdns_change_t* change) {
+    if (change->op == ChangeAdd) {
+        return _add_record_raw(ctx, change->domain, change->record_type, change->record_class,
+            change->rdata, change->length, change->ttl);
+    }
+    if (change->op == ChangeGenerate) {
+        uint32_t range[3];
+        char rhs[256];
+        uint16_t rhs_len = change->length - sizeof (range);
+        if (change->length < sizeof (range) || rhs_len > 255) {
+            return -1;
         }
-        domain++;
-        p_dns_string++;
+        memcpy(range, change->rdata, sizeof (range));
+        memcpy(rhs, change->rdata + sizeof (range), rhs_len);
+        rhs[rhs_len] = '\0';
+        return emdns_add_generate(ctx, ntohl(range[0]), ntohl(range[1]), ntohl(range[2]),
+            change->domain, change->record_type, change->record_class, rhs, change->ttl);
     }
-    *p_dns_string = '\0';
-    return dns_string;
+    _remove_records(ctx, change, 0);
+    return 0;
 }
 
-static uint32_t _to_ip_value(char* ip) {
-    uint32_t ip_value = 0x00000000;
-    char buf[4];
-    char* p_buf = buf;
-    char* p_ip = ip;
-    uint8_t i = 4;
-    while (i--) {
-        while (*p_ip != '.' && *p_ip != '\0') {
-            *p_buf = *p_ip;
-            p_buf++;
-            p_ip++;
-        }
-        (*p_buf) = '\0';
-        ip_value = (ip_value << 8) | atoi(buf);
-        p_buf = buf;
-        p_ip++;
-    }
-    return ip_value;
+void emdns_set_update_hook(emdns_ctx_t* ctx, emdns_update_hook_t hook) {
+    ctx->update_hook = hook;
 }
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
+void emdns_foreach_record(emdns_ctx_t* ctx, emdns_record_callback_t callback, void* arg) {
+    emdns_change_t change;
+    char domain[256];
+    char record_rdata[EMDNS_RDATA_MAX];
+    for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+        names_decode(&ctx->names, record->domain, domain);
+        _record_change(ctx, record, &change, record_rdata);
+        change.domain = domain;
+        callback(&change, arg);
+    }
 
-static emdns_record_t* _find_record(char* domain, dns_record_t record_type, dns_class_t record_class, emdns_record_t* start) {
-#else
+    char rdata[3 * sizeof (uint32_t) + 256];
+    change.op = ChangeGenerate;
+    for (emdns_generate_t* generate = ctx->generates; generate != 0; generate = generate->next) {
+        uint32_t range[3] = {htonl(generate->start), htonl(generate->stop), htonl(generate->step)};
+        uint16_t rhs_len = strlen(generate->rhs);
+        if (rhs_len > 255) {
+            continue;
+        }
+        memcpy(rdata, range, sizeof (range));
+        memcpy(rdata + sizeof (range), generate->rhs, rhs_len);
 
-static emdns_record_t* _find_record(char* domain, dns_record_t record_type, emdns_record_t* start) {
-#endif
-    emdns_record_t* ptr_record = start;
-    while (ptr_record != 0) {
-        if (ptr_record->record_type == record_type &&
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
-            ptr_record->record_class == record_class &&
-#endif                
-            strcmp(ptr_record->domain, domain) == 0) {
-            return ptr_record;
+        change.domain = generate->lhs;
+        change.record_type = generate->record_type;
+        change.record_class = generate->record_class;
+        change.ttl = generate->ttl;
+        change.rdata = rdata;
+        change.length = sizeof (range) + rhs_len;
+        callback(&change, arg);
+    }
+}
+
+void emdns_memory_usage(emdns_ctx_t* ctx, emdns_memory_t* usage) {
+    usage->records = 0;
+    usage->record_bytes = 0;
+    for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+        usage->records++;
+        usage->record_bytes += sizeof (emdns_record_t) + RR_HEADER_LEN + record->length;
+    }
+    usage->encoded_bytes = 0;
+    for (uint32_t i = 0; i < ctx->encoded_buckets; i++) {
+        for (emdns_encoded_t* encoded = ctx->encoded_index[i]; encoded != 0; encoded = encoded->next) {
+            usage->encoded_bytes += sizeof (emdns_encoded_t) + encoded->rrset_count * sizeof (emdns_rrset_t) + encoded->length;
         }
-        ptr_record = ptr_record->next;
     }
-    return 0;
+    usage->names = names_count(&ctx->names);
+    usage->name_bytes = names_memory(&ctx->names);
+    usage->name_bytes_unshared = names_memory_unshared(&ctx->names);
 }
 
-void emdns_resolve_raw(char* request_buffer, char* response_buffer, uint16_t response_max, uint16_t* answer_len) {
-    dns_header_t* request = (dns_header_t*) request_buffer;
-    dns_header_t* response = (dns_header_t*) response_buffer;
+static void _free_record(emdns_ctx_t* ctx, emdns_record_t* record) {
+    _release_rdata(ctx, _record_type(record), _record_rdata(record));
+    names_release(&ctx->names, record->domain);
+    free(record);
+}
 
-    // prepare header
-    memcpy(response_buffer, request_buffer, sizeof (dns_header_t));
-    MOVE(request_buffer, sizeof (dns_header_t));
-    MOVE(response_buffer, sizeof (dns_header_t));
+/**
+ * Find the length of a name in rdata, which has to end within the rdata.
+ *
+ * @return length including the terminating zero, -1 if it is invalid
+ */
+static int _rdata_name_len(char* name, char* end) {
+    char* p = name;
+    while (p < end && *p != '\0') {
+        MOVE(p, (uint8_t) *p + 1);
+    }
+    return p < end ? p - name + 1 : -1;
+}
 
-    response->flags = htons(FlagQR | FlagAA); // set response and AA flag
-    response->qdcount = htons(0);
-    response->ancount = htons(0);
-    response->nscount = htons(0);
-    response->arcount = htons(0);
+/**
+ * Convert rdata from wire format to the format it is stored in, replacing
+ * names by references. With intern set, a reference to the names is taken,
+ * otherwise the names have to be interned already.
+ *
+ * @return length of the stored rdata, -1 if the rdata is invalid or a name is
+ *         not interned
+ */
+static int _store_rdata(emdns_ctx_t* ctx, dns_record_t record_type, char* rdata, uint16_t length, char* stored, char intern) {
+    char* end = rdata + length;
+    char* p = stored;
+    uint8_t names = 0;
+    uint32_t name[2];
 
-    // prepare domain
-    uint8_t* requested_domain = request_buffer;
-    uint8_t len = strlen(request_buffer);
+    switch (record_type) {
+        case RecordMX:
+            if (length < sizeof (uint16_t)) {
+                return -1;
+            }
+            memcpy(p, rdata, sizeof (uint16_t));
+            MOVE(p, sizeof (uint16_t));
+            MOVE(rdata, sizeof (uint16_t));
+            // fall through
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+            names = 1;
+            break;
 
-    MOVE(request_buffer, len + 1);
+        case RecordSOA:
+            names = 2;
+            break;
 
-    dns_record_t type;
-    dns_class_t class;
-    UNPACK16_N2H(request_buffer, type);
-    UNPACK16_N2H(request_buffer, class);
+        default:
+            memcpy(stored, rdata, length);
+            return length;
+    }
 
-    emdns_record_t* record = records;
-    while (1) {
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
-        emdns_record_t* record = _find_record(requested_domain, type, class, record);
-#else
-        record = (class == ClassIN ? _find_record(requested_domain, type, record) : 0);
-#endif
-        if (record == 0) {
-#ifndef EMDNS_DISABLE_ALIAS_RESOLVING
-            if (type != RecordCNAME) {
-                // try to find alias
-#ifdef EMDNS_SUPPORT_ALL_CLASSES                
-                emdns_record_t* alias = _find_record(requested_domain, RecordCNAME, class, records);
-#else
-                emdns_record_t* alias = _find_record(requested_domain, RecordCNAME, records);
-#endif                
-                if (alias) {
-                    response->ancount++;
-                    pack_resource_record(alias, &response_buffer);
-                    requested_domain = alias->response;
-                    record = records;
-                    continue;
-                }
+    for (uint8_t i = 0; i < names; i++) {
+        int len = _rdata_name_len(rdata, end);
+        if (len > 0) {
+            name[i] = (intern ? names_intern(&ctx->names, rdata) : names_lookup(&ctx->names, rdata));
+        }
+        if (len <= 0 || name[i] == NAME_NONE) {
+            while (intern && i-- > 0) {
+                names_release(&ctx->names, name[i]);
             }
-#endif                        
-            break;
+            return -1;
         }
-        else {
-            response->ancount++;
-            pack_resource_record(record, &response_buffer);
-            record = record->next;
+        memcpy(p, &name[i], sizeof (uint32_t));
+        MOVE(p, sizeof (uint32_t));
+        MOVE(rdata, len);
+    }
+
+    // serial and the timers of SOA records
+    if ((size_t) (end - rdata) != (record_type == RecordSOA ? 5 * sizeof (uint32_t) : 0)) {
+        while (intern && names-- > 0) {
+            names_release(&ctx->names, name[names]);
         }
+        return -1;
     }
+    memcpy(p, rdata, end - rdata);
+    MOVE(p, end - rdata);
+    return p - stored;
+}
 
-#ifdef EMDNS_ENABLE_LOGGING
-    printf("%d records found.\n", response->ancount);
-#endif      
+/**
+ * Convert stored rdata back to wire format.
+ *
+ * @return length of the rdata
+ */
+static uint16_t _load_rdata(emdns_ctx_t* ctx, dns_record_t record_type, char* stored, uint16_t length, char* rdata) {
+    char* end = stored + length;
+    char* p = rdata;
+    uint8_t names = 0;
+    uint32_t name;
 
-    if (response->ancount == 0) {
-        response->flags = htons(FlagQR | FlagAA | FlagErrName);
-        *answer_len = sizeof (dns_header_t);
+    switch (record_type) {
+        case RecordMX:
+            memcpy(p, stored, sizeof (uint16_t));
+            MOVE(p, sizeof (uint16_t));
+            MOVE(stored, sizeof (uint16_t));
+            // fall through
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+            names = 1;
+            break;
+
+        case RecordSOA:
+            names = 2;
+            break;
+
+        default:
+            // no names
+            break;
     }
-    else {
-        response->ancount = htons(response->ancount);
-        *answer_len = (response_buffer - (char*) response);
+
+    for (uint8_t i = 0; i < names; i++) {
+        memcpy(&name, stored, sizeof (uint32_t));
+        MOVE(stored, sizeof (uint32_t));
+        MOVE(p, names_decode(&ctx->names, name, p) + 1);
     }
+    memcpy(p, stored, end - stored);
+    MOVE(p, end - stored);
+    return p - rdata;
 }
 
-static void pack_resource_record(emdns_record_t* record, char** response_buffer) {
-    if (record != 0) {
-        uint16_t len = strlen(record->domain);
-        memcpy(*response_buffer, record->domain, len + 1);
-        MOVE(*response_buffer, len + 1);
+static void _release_rdata(emdns_ctx_t* ctx, dns_record_t record_type, char* stored) {
+    uint8_t names = (record_type == RecordSOA ? 2 : 1);
+    uint32_t name;
 
-        PACK16(*response_buffer, htons(record->record_type));
-#ifdef EMDNS_SUPPORT_ALL_CLASSES        
-        PACK16(*response_buffer, htons(record->record_class));
-#else
-        PACK16(*response_buffer, htons(ClassIN));
-#endif
-        PACK32(*response_buffer, htonl(record->ttl));
-        PACK16(*response_buffer, htons(record->length));
+    switch (record_type) {
+        case RecordMX:
+            MOVE(stored, sizeof (uint16_t));
+            // fall through
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+        case RecordSOA:
+            for (uint8_t i = 0; i < names; i++) {
+                memcpy(&name, stored, sizeof (uint32_t));
+                MOVE(stored, sizeof (uint32_t));
+                names_release(&ctx->names, name);
+            }
+            break;
+
+        default:
+            // no names
+            break;
+    }
+}
+
+/**
+ * Prepare a stored record in wire format, as a ChangeAdd change. The domain is
+ * left to the caller, as it is often known already.
+ *
+ * @param rdata buffer for the rdata
+ * @return the change
+ */
+static emdns_change_t* _record_change(emdns_ctx_t* ctx, emdns_record_t* record, emdns_change_t* change, char* rdata) {
+    change->op = ChangeAdd;
+    change->record_type = _record_type(record);
+    change->record_class = _record_class(record);
+    change->ttl = _record_ttl(record);
+    change->rdata = rdata;
+    change->length = _load_rdata(ctx, _record_type(record), _record_rdata(record), record->length, rdata);
+    return change;
+}
 
-        memcpy(*response_buffer, record->response, record->length);
-        MOVE(*response_buffer, record->length);
+static int _add_record_raw(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class, char* rdata, uint16_t length, uint32_t ttl) {
+    char stored[EMDNS_RDATA_MAX];
+    if (length > EMDNS_RDATA_MAX || !_class_supported(ctx, record_class)) {
+        return -1;
+    }
+    int stored_len = _store_rdata(ctx, record_type, rdata, length, stored, 1);
+    if (stored_len < 0) {
+        return -1;
+    }
+    emdns_record_t* entry = malloc(sizeof (emdns_record_t) + RR_HEADER_LEN + stored_len);
+    if (entry != 0) {
+        entry->domain = names_intern(&ctx->names, domain);
     }
-}
\ No newline at end of file
+    if (entry == 0 || entry->domain == NAME_NONE) {
+        _release_rdata(ctx, record_type, stored);
+        free(entry);
+        return -1;
+    }
+
+    entry->length = stored_len;
+
+    // the header is encoded once, see _pack_record
+    char* p = entry->wire;
+    PACK16(p, htons(record_type));
+    PACK16(p, htons(record_class));
+    PACK32(p, htonl(ttl));
+    PACK16(p, htons(length));
+    memcpy(p, stored, stored_len);
+
+    entry->next = ctx->records;
+    ctx->records = entry;
+    if (_encoded_add(ctx, entry) != 0) {
+        ctx->records = entry->next;
+        _free_record(ctx, entry);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A change converted to the format of the stored records, to compare it with
+ * them.
+ */
+typedef struct {
+    uint32_t domain;
+    char rdata[EMDNS_RDATA_MAX];
+    uint16_t length;
+} record_key_t;
+
+/**
+ * @return 0 = success, -1 = no record can match the change
+ */
+static int _change_key(emdns_ctx_t* ctx, emdns_change_t* change, record_key_t* key) {
+    key->domain = names_lookup(&ctx->names, change->domain);
+    if (key->domain == NAME_NONE) {
+        return -1;
+    }
+    if (change->op == ChangeAdd || change->op == ChangeDeleteRecord) {
+        int length = (change->length <= EMDNS_RDATA_MAX ?
+            _store_rdata(ctx, change->record_type, change->rdata, change->length, key->rdata, 0) : -1);
+        if (length < 0) {
+            return -1;
+        }
+        key->length = length;
+    }
+    return 0;
+}
+
+/**
+ * Check if a record is affected by a change. Records are compared including
+ * rdata for additions and deletions of single records.
+ */
+static char _matches(emdns_record_t* record, emdns_change_t* change, record_key_t* key) {
+    if (change->op != ChangeDeleteName && _record_type(record) != change->record_type) {
+        return 0;
+    }
+    if (_record_class(record) != change->record_class) {
+        return 0;
+    }
+    if (change->op == ChangeAdd || change->op == ChangeDeleteRecord) {
+        if (record->length != key->length || memcmp(_record_rdata(record), key->rdata, key->length) != 0) {
+            return 0;
+        }
+    }
+    return record->domain == key->domain;
+}
+
+static emdns_record_t* _find_match(emdns_ctx_t* ctx, emdns_change_t* change) {
+    record_key_t key;
+    if (_change_key(ctx, change, &key) != 0) {
+        return 0;
+    }
+    for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+        if (_matches(record, change, &key)) {
+            return record;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Remove the records matching a change.
+ *
+ * @param report 1 = pass every removed record to the update hook, as a
+ *        ChangeDeleteRecord change
+ * @return number of records removed
+ */
+static int _remove_records(emdns_ctx_t* ctx, emdns_change_t* change, char report) {
+    // deleting whole names or RRsets never removes the SOA record and the NS
+    // records of a zone apex (RFC 2136 3.4.2.3)
+    char protect = (change->op == ChangeDeleteName || change->op == ChangeDeleteRRset);
+    char apex = 0;
+    if (protect) {
+        emdns_change_t soa = *change;
+        soa.op = ChangeDeleteRRset;
+        soa.record_type = RecordSOA;
+        apex = (_find_match(ctx, &soa) != 0);
+    }
+
+    record_key_t key;
+    if (_change_key(ctx, change, &key) != 0) {
+        return 0;
+    }
+    emdns_record_t** ptr_record = &ctx->records;
+    int records_removed = 0;
+    while (*ptr_record != 0) {
+        emdns_record_t* record = *ptr_record;
+        if (_matches(record, change, &key) &&
+            !(protect && (_record_type(record) == RecordSOA || (apex && _record_type(record) == RecordNS)))) {
+            if (report) {
+                emdns_change_t removed;
+                char rdata[EMDNS_RDATA_MAX];
+                _record_change(ctx, record, &removed, rdata);
+                removed.op = ChangeDeleteRecord;
+                removed.domain = change->domain;
+                ctx->update_hook(&removed);
+            }
+            *ptr_record = record->next;
+            _free_record(ctx, record);
+            records_removed++;
+            continue;
+        }
+        ptr_record = &record->next;
+    }
+    if (records_removed > 0) {
+        _encoded_update(ctx, key.domain, change->record_class);
+    }
+    return records_removed;
+}
+
+/**
+ * Apply a change made by a dynamic update and pass it on to the update hook.
+ * Removals are passed on record by record, so every change passed on can be
+ * undone by its inverse.
+ * 
+ * @return 1 if the records were changed, 0 otherwise
+ */
+static char _apply_update(emdns_ctx_t* ctx, emdns_change_t* change) {
+    if (change->op != ChangeAdd) {
+        return _remove_records(ctx, change, 1) > 0;
+    }
+    if (_find_match(ctx, change) != 0 || emdns_apply_change(ctx, change) != 0) {
+        return 0;
+    }
+    ctx->update_hook(change);
+    return 1;
+}
+
+static int _read_name(char* message, uint16_t message_len, uint16_t* pos, char* domain) {
+    uint32_t p = *pos;
+    uint16_t out = 0;
+    uint8_t jumps = 0;
+    char jumped = 0;
+
+    while (1) {
+        if (p >= message_len) {
+            return -1;
+        }
+        uint8_t label = message[p];
+        if ((label & 0xC0) == 0xC0) {
+            // compression pointer, limit the number of jumps to avoid loops
+            if (p + 1 >= message_len || ++jumps > 128) {
+                return -1;
+            }
+            if (!jumped) {
+                *pos = p + 2;
+                jumped = 1;
+            }
+            p = ((label & 0x3F) << 8) | (uint8_t) message[p + 1];
+            continue;
+        }
+        if (label > 63 || p + label + 1 > message_len || out + label + 1 > 254) {
+            return -1;
+        }
+        if (label == 0) {
+            break;
+        }
+        memcpy(domain + out, message + p, label + 1);
+        out += label + 1;
+        p += label + 1;
+    }
+
+    domain[out] = '\0';
+    if (!jumped) {
+        *pos = p + 1;
+    }
+    return 0;
+}
+
+static int _read_rr(char* message, uint16_t message_len, uint16_t* pos, emdns_change_t* rr, uint16_t* rdata_pos) {
+    if (_read_name(message, message_len, pos, rr->domain) != 0 || *pos + 10 > message_len) {
+        return -1;
+    }
+    char* p = message + *pos;
+    UNPACK16_N2H(p, rr->record_type);
+    UNPACK16_N2H(p, rr->record_class);
+    UNPACK32_N2H(p, rr->ttl);
+    UNPACK16_N2H(p, rr->length);
+
+    *rdata_pos = *pos + 10;
+    if ((uint32_t) *rdata_pos + rr->length > message_len) {
+        return -1;
+    }
+    *pos = *rdata_pos + rr->length;
+    return 0;
+}
+
+/**
+ * Convert the rdata of a record in a message to the format the records are
+ * stored in, i.e. without compression.
+ */
+static int _read_rdata(char* message, uint16_t rdata_pos, emdns_change_t* rr, char* rdata) {
+    uint16_t end = rdata_pos + rr->length;
+    uint16_t pos = rdata_pos;
+    char* p = rdata;
+
+    switch (rr->record_type) {
+        case RecordA:
+            if (rr->length != sizeof (uint32_t)) {
+                return -1;
+            }
+            break;
+
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+            if (_read_name(message, end, &pos, p) != 0) {
+                return -1;
+            }
+            MOVE(p, strlen(p) + 1);
+            break;
+
+        case RecordMX:
+            if (rr->length < sizeof (uint16_t)) {
+                return -1;
+            }
+            memcpy(p, message + pos, sizeof (uint16_t));
+            MOVE(p, sizeof (uint16_t));
+            pos += sizeof (uint16_t);
+            if (_read_name(message, end, &pos, p) != 0) {
+                return -1;
+            }
+            MOVE(p, strlen(p) + 1);
+            break;
+
+        case RecordSOA:
+            for (uint8_t i = 0; i < 2; i++) {
+                if (_read_name(message, end, &pos, p) != 0) {
+                    return -1;
+                }
+                MOVE(p, strlen(p) + 1);
+            }
+            if (pos + 5 * sizeof (uint32_t) != end) {
+                return -1;
+            }
+            memcpy(p, message + pos, 5 * sizeof (uint32_t));
+            MOVE(p, 5 * sizeof (uint32_t));
+            pos = end;
+            break;
+
+        default:
+            // no names, copied below
+            break;
+    }
+
+    if (p == rdata) {
+        // no names, copy as it is
+        if (rr->length > EMDNS_RDATA_MAX) {
+            return -1;
+        }
+        memcpy(p, message + pos, rr->length);
+        MOVE(p, rr->length);
+        pos = end;
+    }
+    if (pos != end) {
+        return -1;
+    }
+
+    rr->rdata = rdata;
+    rr->length = p - rdata;
+    return 0;
+}
+
+/**
+ * Check if a prerequisite section contains a record, compared including its
+ * rdata.
+ *
+ * @param pos position of the prerequisite section
+ * @param record the record, its rdata in uncompressed wire format
+ */
+static char _prerequisite_contains(char* request_buffer, uint16_t request_len, uint16_t pos, uint16_t prcount, emdns_change_t* record) {
+    char domain[256];
+    char rdata[EMDNS_RDATA_MAX];
+    uint16_t rdata_pos;
+    emdns_change_t rr;
+    rr.domain = domain;
+
+    for (uint16_t i = 0; i < prcount; i++) {
+        if (_read_rr(request_buffer, request_len, &pos, &rr, &rdata_pos) != 0) {
+            return 0;
+        }
+        if (rr.record_class == record->record_class && rr.record_type == record->record_type &&
+            strcmp(domain, record->domain) == 0 &&
+            _read_rdata(request_buffer, rdata_pos, &rr, rdata) == 0 &&
+            rr.length == record->length && memcmp(rdata, record->rdata, rr.length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check the value dependent prerequisites (RFC 2136 2.4.2): the records of
+ * an RRset have to be exactly the ones listed. The listed ones are known to
+ * exist, so only the stored records are looked up in the section.
+ *
+ * @param pos position of the prerequisite section
+ * @return 1 if all RRsets match, 0 otherwise
+ */
+static char _prerequisite_rrsets(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len, uint16_t pos, uint16_t prcount, dns_class_t zone_class) {
+    uint16_t prerequisites = pos;
+    char domain[256];
+    char rdata[EMDNS_RDATA_MAX];
+    uint16_t rdata_pos;
+    emdns_change_t rr;
+    record_key_t key;
+    rr.domain = domain;
+
+    for (uint16_t i = 0; i < prcount; i++) {
+        if (_read_rr(request_buffer, request_len, &pos, &rr, &rdata_pos) != 0) {
+            return 0;
+        }
+        if (rr.record_class != zone_class) {
+            continue;
+        }
+        rr.op = ChangeDeleteRRset;
+        if (_change_key(ctx, &rr, &key) != 0) {
+            return 0;
+        }
+        for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+            if (_matches(record, &rr, &key)) {
+                emdns_change_t stored;
+                _record_change(ctx, record, &stored, rdata);
+                stored.domain = domain;
+                if (!_prerequisite_contains(request_buffer, request_len, prerequisites, prcount, &stored)) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Compare the serial numbers of two SOA records in wire format, with serial
+ * number arithmetic (RFC 1982).
+ *
+ * @return 1 if the serial of soa is greater than the one of old
+ */
+static char _serial_newer(emdns_change_t* soa, emdns_change_t* old) {
+    uint32_t serial, old_serial;
+    memcpy(&serial, soa->rdata + soa->length - 5 * sizeof (uint32_t), sizeof (uint32_t));
+    memcpy(&old_serial, old->rdata + old->length - 5 * sizeof (uint32_t), sizeof (uint32_t));
+    return (int32_t) (ntohl(serial) - ntohl(old_serial)) > 0;
+}
+
+/**
+ * Process a dynamic update (RFC 2136). Prerequisites are checked and the
+ * update section is validated first, so that it is applied either completely
+ * or not at all.
+ * 
+ * @return response code
+ */
+static uint16_t _process_update(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len) {
+    char* zone;
+    char domain[256];
+    char rdata[EMDNS_RDATA_MAX];
+    char old_rdata[EMDNS_RDATA_MAX];
+    uint16_t zone_type, zone_class, rdata_pos;
+    emdns_change_t rr;
+    rr.domain = domain;
+
+    if (ctx->update_hook == 0) {
+        return FlagErrRefused;
+    }
+    if (request_len < sizeof (dns_header_t) || _header_get(request_buffer, HEADER_QDCOUNT) != 1) {
+        return FlagErrFormat;
+    }
+    uint16_t prcount = _header_get(request_buffer, HEADER_ANCOUNT);
+    uint16_t upcount = _header_get(request_buffer, HEADER_NSCOUNT);
+
+    // zone section
+    if (_read_question(request_buffer + sizeof (dns_header_t), request_len - sizeof (dns_header_t),
+        &zone, &zone_type, &zone_class) != 0 || zone_type != RecordSOA) {
+        return FlagErrFormat;
+    }
+    uint16_t pos = sizeof (dns_header_t) + strlen(zone) + 1 + 4;
+
+    emdns_change_t soa = {ChangeDeleteRRset, zone, RecordSOA, zone_class, 0, 0, 0};
+    if (_find_match(ctx, &soa) == 0) {
+        return FlagErrNotAuth;
+    }
+
+    // prerequisite section
+    uint16_t prerequisites = pos;
+    char value_dependent = 0;
+    for (uint16_t i = 0; i < prcount; i++) {
+        if (_read_rr(request_buffer, request_len, &pos, &rr, &rdata_pos) != 0 || rr.ttl != 0) {
+            return FlagErrFormat;
+        }
+        if (!_in_zone(domain, zone)) {
+            return FlagErrNotZone;
+        }
+        if (rr.record_class == zone_class) {
+            // RRset exists (value dependent), every record has to exist here,
+            // the RRsets are compared as a whole below
+            if (rr.record_type >= 128 || _read_rdata(request_buffer, rdata_pos, &rr, rdata) != 0) {
+                return FlagErrFormat;
+            }
+            rr.op = ChangeDeleteRecord;
+            if (_find_match(ctx, &rr) == 0) {
+                return FlagErrNXRRSet;
+            }
+            value_dependent = 1;
+            continue;
+        }
+        if (rr.record_class != ClassANY && rr.record_class != ClassNONE) {
+            return FlagErrFormat;
+        }
+        if (rr.length != 0) {
+            return FlagErrFormat;
+        }
+
+        char in_use = (rr.record_class == ClassANY);
+        char any_type = (rr.record_type == RecordANY);
+        rr.op = (any_type ? ChangeDeleteName : ChangeDeleteRRset);
+        rr.record_class = zone_class;
+        char exists = (_find_match(ctx, &rr) != 0);
+
+        if (in_use && !exists) {
+            return any_type ? FlagErrName : FlagErrNXRRSet;
+        }
+        if (!in_use && exists) {
+            return any_type ? FlagErrYXDomain : FlagErrYXRRSet;
+        }
+    }
+
+    if (value_dependent && !_prerequisite_rrsets(ctx, request_buffer, request_len, prerequisites, prcount, zone_class)) {
+        return FlagErrNXRRSet;
+    }
+
+    // validate the update section before changing anything
+    uint16_t updates = pos;
+    for (uint16_t i = 0; i < upcount; i++) {
+        if (_read_rr(request_buffer, request_len, &pos, &rr, &rdata_pos) != 0) {
+            return FlagErrFormat;
+        }
+        if (!_in_zone(domain, zone)) {
+            return FlagErrNotZone;
+        }
+        if (rr.record_class == zone_class || rr.record_class == ClassNONE) {
+            if (rr.record_type >= 128 || (rr.record_class == ClassNONE && rr.ttl != 0) ||
+                _read_rdata(request_buffer, rdata_pos, &rr, rdata) != 0) {
+                return FlagErrFormat;
+            }
+        }
+        else if (rr.record_class == ClassANY) {
+            if (rr.ttl != 0 || rr.length != 0 || (rr.record_type >= 128 && rr.record_type != RecordANY)) {
+                return FlagErrFormat;
+            }
+        }
+        else {
+            return FlagErrFormat;
+        }
+    }
+
+    // apply the update section
+    char changed = 0;
+    char soa_updated = 0;
+    pos = updates;
+    for (uint16_t i = 0; i < upcount; i++) {
+        if (_read_rr(request_buffer, request_len, &pos, &rr, &rdata_pos) != 0) {
+            // the section has been checked already
+            break;
+        }
+
+        if (rr.record_class == ClassANY) {
+            rr.op = (rr.record_type == RecordANY ? ChangeDeleteName : ChangeDeleteRRset);
+            rr.record_class = zone_class;
+        }
+        else {
+            _read_rdata(request_buffer, rdata_pos, &rr, rdata);
+            if (rr.record_type == RecordSOA) {
+                // the SOA record can be only replaced, and only at the apex
+                if (rr.record_class == ClassNONE || strcmp(domain, zone) != 0) {
+                    continue;
+                }
+                // and only by a newer one (RFC 2136 3.4.2.2), the new record is
+                // added first, so the zone keeps its SOA if it can not be added
+                emdns_record_t* old = _find_match(ctx, &soa);
+                emdns_change_t old_soa;
+                if (old == 0 || !_serial_newer(&rr, _record_change(ctx, old, &old_soa, old_rdata))) {
+                    continue;
+                }
+                rr.op = ChangeAdd;
+                rr.record_class = zone_class;
+                if (_apply_update(ctx, &rr)) {
+                    old_soa.op = ChangeDeleteRecord;
+                    old_soa.domain = zone;
+                    _apply_update(ctx, &old_soa);
+                    changed = 1;
+                    soa_updated = 1;
+                }
+                continue;
+            }
+            rr.op = (rr.record_class == ClassNONE ? ChangeDeleteRecord : ChangeAdd);
+            rr.record_class = zone_class;
+        }
+
+        changed |= _apply_update(ctx, &rr);
+    }
+
+    emdns_record_t* old = _find_match(ctx, &soa);
+    if (changed && !soa_updated && old != 0) {
+        // increment the serial number of the zone
+        uint32_t serial;
+        emdns_change_t old_soa, new_soa;
+        _record_change(ctx, old, &old_soa, old_rdata);
+        old_soa.op = ChangeDeleteRecord;
+        old_soa.domain = zone;
+        new_soa = old_soa;
+        new_soa.op = ChangeAdd;
+        new_soa.rdata = rdata;
+        memcpy(rdata, old_rdata, old_soa.length);
+        memcpy(&serial, rdata + old_soa.length - 5 * sizeof (uint32_t), sizeof (uint32_t));
+        serial = htonl(ntohl(serial) + 1);
+        memcpy(rdata + old_soa.length - 5 * sizeof (uint32_t), &serial, sizeof (uint32_t));
+
+        old_soa.ttl = 0;
+        if (_apply_update(ctx, &new_soa)) {
+            _apply_update(ctx, &old_soa);
+        }
+    }
+
+#ifdef EMDNS_ENABLE_LOGGING
+    printf("Update applied.\n");
+#endif
+    return FlagNoError;
+}
+
+/**
+ * @return the domain in DNS format, to be freed by the caller, 0 if it is not
+ *         a valid domain
+ */
+static char* _to_dns_string(char* domain) {
+    char* dns_string = malloc(2 + strlen(domain));
+    if (dns_string != 0 && _to_dns_buffer(domain, dns_string) != 0) {
+        free(dns_string);
+        return 0;
+    }
+    return dns_string;
+}
+
+/**
+ * @param dns_string buffer of at least strlen(domain) + 2 bytes
+ * @return 0 = success, -1 = a label is empty or longer than 63 characters, or
+ *         the domain is longer than 255
+ */
+static int _to_dns_buffer(char* domain, char* dns_string) {
+    char* p_dns_string = dns_string + 1;
+    char* p_length_byte = dns_string;
+    *p_length_byte = 0;
+
+    if (strcmp(domain, ".") == 0) {
+        // the root
+        domain++;
+    }
+    while (*domain != '\0') {
+        if (*domain != '.') {
+            if (*p_length_byte == 63) {
+                return -1;
+            }
+            *p_dns_string = *domain;
+            (*p_length_byte)++;
+        }
+        else {
+            // only the last label is empty
+            if (*p_length_byte == 0) {
+                return -1;
+            }
+            p_length_byte = p_dns_string;
+            *p_length_byte = 0;
+        }
+        domain++;
+        p_dns_string++;
+    }
+    *p_dns_string = '\0';
+    return (p_dns_string - dns_string + 1 - (*p_length_byte == 0) <= 255 ? 0 : -1);
+}
+
+/**
+ * @return 0 = success, -1 = not an IPv4 address in dotted decimal notation
+ */
+static int _to_ip_value(char* ip, uint32_t* ip_value) {
+    *ip_value = 0x00000000;
+    for (uint8_t i = 0; i < 4; i++) {
+        uint16_t part = 0;
+        uint8_t digits = 0;
+        while (*ip >= '0' && *ip <= '9' && digits < 3) {
+            part = part * 10 + (*ip - '0');
+            digits++;
+            ip++;
+        }
+        if (digits == 0 || part > 255 || *ip != (i < 3 ? '.' : '\0')) {
+            return -1;
+        }
+        *ip_value = (*ip_value << 8) | part;
+        ip++;
+    }
+    return 0;
+}
+
+
+/**
+ * Scan the records, inlined with all_classes being a constant, so that the
+ * class is not compared at all if the context does not support classes. Type
+ * and class are compared in network byte order, as they are in the header.
+ */
+static inline __attribute__((always_inline)) emdns_record_t* _scan_records(emdns_record_t* ptr_record, uint32_t domain, uint16_t record_type, uint16_t record_class, const char all_classes) {
+    uint16_t type = htons(record_type);
+    uint16_t class = htons(record_class);
+    while (ptr_record != 0) {
+        uint16_t header[2];
+        memcpy(header, ptr_record->wire, sizeof (header));
+        if (ptr_record->domain == domain &&
+            header[0] == type &&
+            (!all_classes || header[1] == class)) {
+            return ptr_record;
+        }
+        ptr_record = ptr_record->next;
+    }
+    return 0;
+}
+
+static emdns_record_t* _find_record(emdns_ctx_t* ctx, uint32_t domain, dns_record_t record_type, dns_class_t record_class, emdns_record_t* start) {
+    if (domain == NAME_NONE) {
+        return 0;
+    }
+    if (ctx->options & OptionAllClasses) {
+        return _scan_records(start, domain, record_type, record_class, 1);
+    }
+    // all records are of class IN
+    return record_class == ClassIN ? _scan_records(start, domain, record_type, ClassIN, 0) : 0;
+}
+
+void emdns_resolve_raw(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len, char* response_buffer, uint16_t response_max, uint16_t* answer_len) {
+    char* request = request_buffer;
+    char* response = response_buffer;
+    uint16_t ancount = 0;
+
+    if (request_len < sizeof (dns_header_t) || response_max < sizeof (dns_header_t)) {
+        // not even a header to answer
+        *answer_len = 0;
+        return;
+    }
+
+    // prepare header
+    memcpy(response_buffer, request_buffer, sizeof (dns_header_t));
+    MOVE(request_buffer, sizeof (dns_header_t));
+    MOVE(response_buffer, sizeof (dns_header_t));
+
+    _header_set(response, HEADER_FLAGS, FlagQR | FlagAA); // set response and AA flag
+    _header_set(response, HEADER_QDCOUNT, 0);
+    _header_set(response, HEADER_ANCOUNT, 0);
+    _header_set(response, HEADER_NSCOUNT, 0);
+    _header_set(response, HEADER_ARCOUNT, 0);
+
+    if ((_header_get(request, HEADER_FLAGS) & FlagOpMask) == FlagOpUpdate) {
+        uint16_t rcode = _process_update(ctx, request, request_len);
+        _header_set(response, HEADER_FLAGS, FlagQR | FlagOpUpdate | rcode);
+        *answer_len = sizeof (dns_header_t);
+        return;
+    }
+
+    // prepare domain
+    char* requested_domain;
+    uint16_t type, class;
+    if (_read_question(request_buffer, request_len - sizeof (dns_header_t), &requested_domain, &type, &class) != 0) {
+        _header_set(response, HEADER_FLAGS, FlagQR | FlagErrFormat);
+        *answer_len = sizeof (dns_header_t);
+        return;
+    }
+
+    if (type == RecordANY) {
+        uint32_t name = names_lookup(&ctx->names, requested_domain);
+        if (_resolve_any(ctx, name, class, requested_domain, response, &response_buffer,
+            response + response_max, &ancount)) {
+            if (ancount == 0) {
+                // not even a single RRset fits, the client retries over TCP
+                _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagTC);
+            }
+            _header_set(response, HEADER_ANCOUNT, ancount);
+            *answer_len = (response_buffer - response);
+        }
+        else {
+            _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagErrName);
+            *answer_len = sizeof (dns_header_t);
+        }
+        return;
+    }
+
+    emdns_record_t* record = ctx->records;
+    emdns_change_t answer;
+    char answer_rdata[EMDNS_RDATA_MAX];
+    char alias_domain[256];
+    generate_lookup_t lookup;
+    char generating = 0;
+    char answered = 0;
+    uint8_t aliases = 0;
+    uint16_t domain_len = strlen(requested_domain) + 1;
+    uint32_t name = names_lookup(&ctx->names, requested_domain);
+    while (1) {
+        emdns_change_t* found = 0;
+        if (record == ctx->records) {
+            // answer the whole RRset at once without scanning the records,
+            // names in rdata are encoded already, rotated if the context
+            // rotates
+            char* data;
+            emdns_rrset_t* rrset = _encoded_rrset(ctx, name, type, class, &data);
+            answered = (rrset != 0);
+            if (rrset == 0) {
+                record = 0;
+            }
+            else if (rrset->count == 1) {
+                // a single record is the owner name followed by the header
+                // and rdata behind its compression pointer
+                if (response_buffer + domain_len + rrset->length - 2 > response + response_max) {
+                    _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagTC);
+                    break;
+                }
+                memcpy(response_buffer, requested_domain, domain_len);
+                memcpy(response_buffer + domain_len, data + 2, rrset->length - 2);
+                MOVE(response_buffer, domain_len + rrset->length - 2);
+                ancount++;
+                record = 0;
+                continue;
+            }
+            else if (rrset->length <= EMDNS_ANY_MAX &&
+                _rrset_copy(data, (ctx->options & (OptionRotate | OptionRotateRandom)) && rrset->count > 1 ?
+                _rrset_rotate(ctx, rrset, data) : 0, rrset->length, requested_domain,
+                response, &response_buffer, response + response_max) == 0) {
+                ancount += rrset->count;
+                record = 0;
+                continue;
+            }
+        }
+        if (record != 0) {
+            record = _find_record(ctx, name, type, class, record);
+        }
+        if (record != 0) {
+            // the RRset does not fit, as many records as possible
+            if (_pack_record(ctx, record, requested_domain, domain_len, &response_buffer,
+                response + response_max) != 0) {
+                _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagTC);
+                break;
+            }
+            ancount++;
+            record = record->next;
+            continue;
+        }
+        if (ctx->generate_count > 0) {
+            // synthesize records from the templates
+            if (!generating) {
+                _generate_lookup_init(ctx, &lookup, requested_domain);
+                generating = 1;
+            }
+            found = _find_generated(ctx, &lookup, type, class, &answer, answer_rdata);
+        }
+        if (found == 0) {
+#ifndef EMDNS_DISABLE_ALIAS_RESOLVING
+            // a name with records of the type has no alias
+            if (type != RecordCNAME && !answered) {
+                // try to find alias
+                emdns_record_t* alias = (_encoded_rrset(ctx, name, RecordCNAME, class, 0) != 0 ?
+                    _find_record(ctx, name, RecordCNAME, class, ctx->records) : 0);
+                if (alias != 0) {
+                    found = _record_change(ctx, alias, &answer, answer_rdata);
+                    found->domain = requested_domain;
+                }
+                else if (ctx->generate_count > 0) {
+                    _generate_lookup_init(ctx, &lookup, requested_domain);
+                    found = _find_generated(ctx, &lookup, RecordCNAME, class, &answer, answer_rdata);
+                }
+                if (found != 0 && aliases++ < EMDNS_ALIAS_MAX) {
+                    if (pack_resource_record(found, &response_buffer, response + response_max) != 0) {
+                        _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagTC);
+                        break;
+                    }
+                    ancount++;
+                    strcpy(alias_domain, found->rdata);
+                    requested_domain = alias_domain;
+                    domain_len = found->length;
+                    name = names_lookup(&ctx->names, requested_domain);
+                    record = ctx->records;
+                    generating = 0;
+                    continue;
+                }
+            }
+#endif                        
+            break;
+        }
+        else {
+            if (pack_resource_record(found, &response_buffer, response + response_max) != 0) {
+                _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagTC);
+                break;
+            }
+            ancount++;
+        }
+    }
+
+#ifdef EMDNS_ENABLE_LOGGING
+    printf("%d records found.\n", ancount);
+#endif      
+
+    if (ancount == 0) {
+        _header_set(response, HEADER_FLAGS, FlagQR | FlagAA | FlagErrName);
+        *answer_len = sizeof (dns_header_t);
+    }
+    else {
+        _header_set(response, HEADER_ANCOUNT, ancount);
+        *answer_len = (response_buffer - response);
+    }
+}
+
+/**
+ * @return 0 = success, -1 = the record does not fit into the response
+ */
+static int pack_resource_record(emdns_change_t* record, char** response_buffer, char* response_end) {
+    uint16_t len = strlen(record->domain);
+    if (*response_buffer + len + 1 + RR_HEADER_LEN + record->length > response_end) {
+        return -1;
+    }
+    memcpy(*response_buffer, record->domain, len + 1);
+    MOVE(*response_buffer, len + 1);
+
+    PACK16(*response_buffer, htons(record->record_type));
+    PACK16(*response_buffer, htons(record->record_class));
+    PACK32(*response_buffer, htonl(record->ttl));
+    PACK16(*response_buffer, htons(record->length));
+
+    memcpy(*response_buffer, record->rdata, record->length);
+    MOVE(*response_buffer, record->length);
+    return 0;
+}
+
+/**
+ * Encode a stored record with the given owner name. Records without names in
+ * their rdata are stored in wire format behind their header and copied at
+ * once, the others get their names decoded behind the header. Answers are
+ * copied from the encoded records of a name, which are encoded with this
+ * when records are added, so names are only decoded per answer for RRsets
+ * which cannot be copied at once.
+ *
+ * @return 0 = success, -1 = the record does not fit into the response
+ */
+static int _pack_record(emdns_ctx_t* ctx, emdns_record_t* record, char* owner, uint16_t owner_len, char** response_buffer, char* response_end) {
+    if (*response_buffer + owner_len + RR_HEADER_LEN + _record_rdata_length(record) > response_end) {
+        return -1;
+    }
+    memcpy(*response_buffer, owner, owner_len);
+    MOVE(*response_buffer, owner_len);
+
+    switch (_record_type(record)) {
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+        case RecordMX:
+        case RecordSOA:
+            memcpy(*response_buffer, record->wire, RR_HEADER_LEN);
+            MOVE(*response_buffer, RR_HEADER_LEN);
+            MOVE(*response_buffer, _load_rdata(ctx, _record_type(record), _record_rdata(record), record->length, *response_buffer));
+            break;
+
+        default:
+            memcpy(*response_buffer, record->wire, RR_HEADER_LEN + record->length);
+            MOVE(*response_buffer, RR_HEADER_LEN + record->length);
+            break;
+    }
+    return 0;
+}
+
+static uint32_t _encoded_bucket(emdns_ctx_t* ctx, uint32_t name) {
+    return (name * 2654435761u) & (ctx->encoded_buckets - 1);
+}
+
+static int _encoded_grow(emdns_ctx_t* ctx) {
+    uint32_t old_buckets = ctx->encoded_buckets;
+    emdns_encoded_t** old_index = ctx->encoded_index;
+    ctx->encoded_buckets = (old_buckets == 0 ? 256 : old_buckets * 2);
+    ctx->encoded_index = calloc(ctx->encoded_buckets, sizeof (emdns_encoded_t*));
+    if (ctx->encoded_index == 0) {
+        ctx->encoded_buckets = old_buckets;
+        ctx->encoded_index = old_index;
+        return -1;
+    }
+    for (uint32_t i = 0; i < old_buckets; i++) {
+        while (old_index[i] != 0) {
+            emdns_encoded_t* encoded = old_index[i];
+            old_index[i] = encoded->next;
+            uint32_t bucket = _encoded_bucket(ctx, encoded->name);
+            encoded->next = ctx->encoded_index[bucket];
+            ctx->encoded_index[bucket] = encoded;
+        }
+    }
+    free(old_index);
+    return 0;
+}
+
+/**
+ * @return the link to the encoded records of a name, or to the end of their
+ *         bucket if there are none
+ */
+static emdns_encoded_t** _encoded_link(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class) {
+    emdns_encoded_t** link = &ctx->encoded_index[_encoded_bucket(ctx, name)];
+    while (*link != 0 && ((*link)->name != name || (*link)->record_class != record_class)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static emdns_encoded_t* _encoded_find(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class) {
+    return (ctx->encoded_buckets > 0 && name != NAME_NONE ? *_encoded_link(ctx, name, record_class) : 0);
+}
+
+static char* _encoded_data(emdns_encoded_t* encoded) {
+    return (char*) (encoded->rrsets + encoded->rrset_count);
+}
+
+static emdns_rrset_t* _rrset_find(emdns_encoded_t* encoded, dns_record_t record_type) {
+    for (uint16_t i = 0; i < encoded->rrset_count; i++) {
+        if (encoded->rrsets[i].record_type == record_type) {
+            return &encoded->rrsets[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find an RRset the way _find_record finds its records, the encoded records
+ * hold every RRset, so there are no records if there is no RRset.
+ *
+ * @param data if not 0, set to the encoded records of the RRset
+ * @return the RRset, 0 = there are no such records
+ */
+static emdns_rrset_t* _encoded_rrset(emdns_ctx_t* ctx, uint32_t name, dns_record_t record_type, dns_class_t record_class, char** data) {
+    if (record_class != ClassIN && !(ctx->options & OptionAllClasses)) {
+        // all records are of class IN
+        return 0;
+    }
+    emdns_encoded_t* encoded = _encoded_find(ctx, name, record_class);
+    emdns_rrset_t* rrset = (encoded != 0 ? _rrset_find(encoded, record_type) : 0);
+    if (rrset != 0 && data != 0) {
+        *data = _encoded_data(encoded) + rrset->offset;
+    }
+    return rrset;
+}
+
+static emdns_encoded_t* _encoded_new(uint32_t name, dns_class_t record_class, uint16_t rrset_count, uint32_t length) {
+    emdns_encoded_t* encoded = malloc(sizeof (emdns_encoded_t) + rrset_count * sizeof (emdns_rrset_t) + length);
+    if (encoded != 0) {
+        encoded->name = name;
+        encoded->record_class = record_class;
+        encoded->rrset_count = rrset_count;
+        encoded->length = length;
+    }
+    return encoded;
+}
+
+/**
+ * Lay out the RRsets after their types, counts and lengths are set, and
+ * choose the smallest one.
+ */
+static void _encoded_layout(emdns_encoded_t* encoded) {
+    uint32_t offset = 0;
+    encoded->count = 0;
+    encoded->smallest = 0;
+    for (uint16_t i = 0; i < encoded->rrset_count; i++) {
+        emdns_rrset_t* rrset = &encoded->rrsets[i];
+        rrset->offset = offset;
+        offset += rrset->length;
+        encoded->count += rrset->count;
+        if (rrset->length < encoded->rrsets[encoded->smallest].length) {
+            encoded->smallest = i;
+        }
+    }
+}
+
+/**
+ * Insert or replace the encoded records of a name.
+ *
+ * @param link link returned by _encoded_link, it is invalid after the call
+ */
+static int _encoded_insert(emdns_ctx_t* ctx, emdns_encoded_t** link, emdns_encoded_t* encoded) {
+    if (*link != 0) {
+        encoded->next = (*link)->next;
+        free(*link);
+        *link = encoded;
+        return 0;
+    }
+    if (ctx->encoded_count >= ctx->encoded_buckets && _encoded_grow(ctx) != 0) {
+        free(encoded);
+        return -1;
+    }
+    link = &ctx->encoded_index[_encoded_bucket(ctx, encoded->name)];
+    encoded->next = *link;
+    *link = encoded;
+    ctx->encoded_count++;
+    return 0;
+}
+
+/**
+ * Encode a record that was just added in front of the records. The encoded
+ * records are in the order of the records, so the record becomes the first
+ * one of its RRset, and its RRset the first one.
+ *
+ * @return 0 = success, -1 = out of memory
+ */
+static int _encoded_add(emdns_ctx_t* ctx, emdns_record_t* record) {
+    if (ctx->encoded_buckets == 0 && _encoded_grow(ctx) != 0) {
+        return -1;
+    }
+    dns_record_t record_type = _record_type(record);
+    dns_class_t record_class = _record_class(record);
+    uint32_t size = 2 + RR_HEADER_LEN + _record_rdata_length(record);
+    emdns_encoded_t** link = _encoded_link(ctx, record->domain, record_class);
+    emdns_encoded_t* old = *link;
+    emdns_rrset_t* old_rrset = (old != 0 ? _rrset_find(old, record_type) : 0);
+
+    // the RRsets of other types follow in their order
+    uint16_t rrset_count = 1;
+    uint32_t length = size + (old_rrset != 0 ? old_rrset->length : 0);
+    for (uint16_t i = 0; old != 0 && i < old->rrset_count; i++) {
+        if (&old->rrsets[i] != old_rrset) {
+            length += old->rrsets[i].length;
+            rrset_count++;
+        }
+    }
+
+    emdns_encoded_t* encoded = _encoded_new(record->domain, record_class, rrset_count, length);
+    if (encoded == 0) {
+        return -1;
+    }
+    char* p = _encoded_data(encoded);
+    char pointer[2] = {0xC0, sizeof (dns_header_t)};
+    _pack_record(ctx, record, pointer, sizeof (pointer), &p, p + size);
+
+    emdns_rrset_t* rrset = &encoded->rrsets[0];
+    rrset->record_type = record_type;
+    rrset->count = 1;
+    rrset->length = size;
+    atomic_init(&rrset->rotation, 0);
+    if (old_rrset != 0) {
+        memcpy(p, _encoded_data(old) + old_rrset->offset, old_rrset->length);
+        MOVE(p, old_rrset->length);
+        rrset->count += old_rrset->count;
+        rrset->length += old_rrset->length;
+        atomic_init(&rrset->rotation, atomic_load_explicit(&old_rrset->rotation, memory_order_relaxed));
+    }
+    for (uint16_t i = 0; old != 0 && i < old->rrset_count; i++) {
+        if (&old->rrsets[i] == old_rrset) {
+            continue;
+        }
+        rrset++;
+        rrset->record_type = old->rrsets[i].record_type;
+        rrset->count = old->rrsets[i].count;
+        rrset->length = old->rrsets[i].length;
+        atomic_init(&rrset->rotation, atomic_load_explicit(&old->rrsets[i].rotation, memory_order_relaxed));
+        memcpy(p, _encoded_data(old) + old->rrsets[i].offset, rrset->length);
+        MOVE(p, rrset->length);
+    }
+    _encoded_layout(encoded);
+    return _encoded_insert(ctx, link, encoded);
+}
+
+/**
+ * Encode the records of a name anew, after records were removed. If memory
+ * runs out, the name is left without encoded records.
+ */
+static void _encoded_update(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class) {
+    if (ctx->encoded_buckets == 0) {
+        return;
+    }
+    emdns_encoded_t** link = _encoded_link(ctx, name, record_class);
+    if (*link != 0) {
+        emdns_encoded_t* old = *link;
+        *link = old->next;
+        free(old);
+        ctx->encoded_count--;
+    }
+
+    // find the RRsets and their sizes, each record takes a compression
+    // pointer, the fixed fields and the rdata
+    emdns_rrset_t* rrsets = 0;
+    uint16_t rrset_count = 0;
+    uint32_t rrset_size = 0;
+    uint32_t length = 0;
+    for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+        if (record->domain != name || _record_class(record) != record_class) {
+            continue;
+        }
+        uint16_t i = 0;
+        while (i < rrset_count && rrsets[i].record_type != _record_type(record)) {
+            i++;
+        }
+        if (i == rrset_count) {
+            if (rrset_count == rrset_size) {
+                rrset_size = (rrset_size == 0 ? 8 : rrset_size * 2);
+                emdns_rrset_t* grown = realloc(rrsets, rrset_size * sizeof (emdns_rrset_t));
+                if (grown == 0) {
+                    free(rrsets);
+                    return;
+                }
+                rrsets = grown;
+            }
+            rrsets[rrset_count].record_type = _record_type(record);
+            rrsets[rrset_count].count = 0;
+            rrsets[rrset_count++].length = 0;
+        }
+        rrsets[i].count++;
+        rrsets[i].length += 2 + RR_HEADER_LEN + _record_rdata_length(record);
+        length += 2 + RR_HEADER_LEN + _record_rdata_length(record);
+    }
+    if (rrset_count == 0) {
+        return;
+    }
+
+    emdns_encoded_t* encoded = _encoded_new(name, record_class, rrset_count, length);
+    if (encoded == 0) {
+        free(rrsets);
+        return;
+    }
+    for (uint16_t i = 0; i < rrset_count; i++) {
+        encoded->rrsets[i].record_type = rrsets[i].record_type;
+        encoded->rrsets[i].count = rrsets[i].count;
+        encoded->rrsets[i].length = rrsets[i].length;
+        atomic_init(&encoded->rrsets[i].rotation, 0);
+    }
+    _encoded_layout(encoded);
+    // the offsets of the found RRsets become the ends of their records
+    for (uint16_t i = 0; i < rrset_count; i++) {
+        rrsets[i].offset = encoded->rrsets[i].offset;
+    }
+    for (emdns_record_t* record = ctx->records; record != 0; record = record->next) {
+        if (record->domain != name || _record_class(record) != record_class) {
+            continue;
+        }
+        // pointer to the owner name, see _rrset_copy
+        char pointer[2] = {0xC0, sizeof (dns_header_t)};
+        uint32_t* offset = &rrsets[_rrset_find(encoded, _record_type(record)) - encoded->rrsets].offset;
+        char* p = _encoded_data(encoded) + *offset;
+        _pack_record(ctx, record, pointer, sizeof (pointer), &p, p + 2 + RR_HEADER_LEN + _record_rdata_length(record));
+        *offset = p - _encoded_data(encoded);
+    }
+    free(rrsets);
+    _encoded_insert(ctx, _encoded_link(ctx, name, record_class), encoded);
+}
+
+/**
+ * Write the owner name and the records from start to end of the encoded
+ * records and then the ones in front of start, so the order is rotated
+ * without touching the records. The owner name replaces the compression
+ * pointer of the first record written, the pointers of the other records are
+ * only rewritten if the owner name is not the first name of the message.
+ *
+ * @return 0 = success, -1 = the records do not fit into the response
+ */
+static int _rrset_copy(char* data, uint32_t start, uint32_t length, char* domain, char* response, char** response_buffer, char* response_end) {
+    uint32_t domain_len = strlen(domain) + 1;
+    if (*response_buffer + domain_len + length - 2 > response_end) {
+        return -1;
+    }
+    uint16_t owner = *response_buffer - response;
+    char* p = *response_buffer;
+    memcpy(p, domain, domain_len);
+    memcpy(p + domain_len, data + start + 2, length - start - 2);
+    if (start > 0) {
+        memcpy(p + domain_len + length - start - 2, data, start);
+    }
+    MOVE(*response_buffer, domain_len + length - 2);
+
+    if (owner != sizeof (dns_header_t)) {
+        uint16_t pointer = htons(0xC000 | owner);
+        p += domain_len;
+        for (char* record = p; record < *response_buffer;) {
+            uint16_t rdata_len;
+            if (record != p) {
+                memcpy(record, &pointer, 2);
+                record += 2;
+            }
+            memcpy(&rdata_len, record + 8, 2);
+            record += 10 + ntohs(rdata_len);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Choose the record an RRset starts with in the next answer.
+ *
+ * @return offset of the record in the encoded records
+ */
+static uint16_t _rrset_rotate(emdns_ctx_t* ctx, emdns_rrset_t* rrset, char* data) {
+    static __thread uint32_t random_state = 0;
+    uint32_t index;
+    if (ctx->options & OptionRotateRandom) {
+        // xorshift, seeded per thread
+        if (random_state == 0) {
+            random_state = (uint32_t) (uintptr_t) &random_state | 1;
+        }
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 17;
+        random_state ^= random_state << 5;
+        index = random_state % rrset->count;
+    }
+    else {
+        index = atomic_fetch_add_explicit(&rrset->rotation, 1, memory_order_relaxed) % rrset->count;
+    }
+
+    uint16_t offset = 0;
+    for (uint32_t i = 0; i < index; i++) {
+        uint16_t rdata_len;
+        memcpy(&rdata_len, data + offset + 10, 2);
+        offset += 12 + ntohs(rdata_len);
+    }
+    return offset;
+}
+
+/**
+ * Answer an ANY query. Unless the context answers with all records, only the
+ * smallest RRset is returned (RFC 8482). All records are only returned if
+ * they fit into the response, otherwise the answer is minimal as well. Names
+ * without stored records are answered from the templates, in the same way.
+ * If not even the minimal answer fits, no records are answered.
+ *
+ * @return 1 if the name has records, 0 otherwise
+ */
+static char _resolve_any(emdns_ctx_t* ctx, uint32_t name, dns_class_t record_class, char* domain, char* response, char** response_buffer, char* response_end, uint16_t* ancount) {
+    emdns_encoded_t* encoded = _encoded_find(ctx, name, record_class);
+    if (encoded == 0) {
+        return _resolve_any_generated(ctx, record_class, domain, response_buffer, response_end, ancount);
+    }
+
+    emdns_rrset_t* smallest = &encoded->rrsets[encoded->smallest];
+    *ancount = 0;
+    if ((ctx->options & OptionFullAny) && encoded->length <= EMDNS_ANY_MAX &&
+        _rrset_copy(_encoded_data(encoded), 0, encoded->length, domain, response, response_buffer, response_end) == 0) {
+        *ancount = encoded->count;
+    }
+    else if (smallest->length <= EMDNS_ANY_MAX &&
+        _rrset_copy(_encoded_data(encoded) + smallest->offset, 0, smallest->length, domain, response,
+        response_buffer, response_end) == 0) {
+        *ancount = smallest->count;
+    }
+    return 1;
+}
+
+/**
+ * Answer an ANY query from the templates. Every template synthesizes a single
+ * record for a name, so the minimal answer is the first synthesized record.
+ *
+ * @return 1 if a template matches the name, 0 otherwise
+ */
+static char _resolve_any_generated(emdns_ctx_t* ctx, dns_class_t record_class, char* domain, char** response_buffer, char* response_end, uint16_t* ancount) {
+    generate_lookup_t lookup;
+    emdns_change_t answer;
+    char answer_rdata[EMDNS_RDATA_MAX];
+
+    if (ctx->generate_count == 0) {
+        return 0;
+    }
+    *ancount = 0;
+    char found = 0;
+    char* first_end = *response_buffer;
+    _generate_lookup_init(ctx, &lookup, domain);
+    while (_find_generated(ctx, &lookup, RecordANY, record_class, &answer, answer_rdata) != 0) {
+        found = 1;
+        if (*ancount > 0 && !(ctx->options & OptionFullAny)) {
+            break;
+        }
+        if (pack_resource_record(&answer, response_buffer, response_end) != 0) {
+            // not all records fit, the answer is minimal
+            if (*ancount > 1) {
+                *response_buffer = first_end;
+                *ancount = 1;
+            }
+            break;
+        }
+        if (++(*ancount) == 1) {
+            first_end = *response_buffer;
+        }
+    }
+    return found;
+}
+
+typedef enum {
+    AxfrLeadingSoa,
+    AxfrRecords,
+    AxfrGenerated,
+    AxfrTrailingSoa,
+    AxfrError,
+    AxfrDone
+} axfr_stage_t;
+
+static emdns_change_t* _axfr_next_record(emdns_axfr_t* axfr, emdns_change_t* record, char* domain, char* rdata);
+static void _axfr_next_generated(emdns_axfr_t* axfr);
+static void _axfr_pack_name(emdns_axfr_t* axfr, char* message, char** buffer, char* domain);
+static char _axfr_pack_record(emdns_axfr_t* axfr, char* message, char** buffer, char* end, emdns_change_t* record);
+
+int emdns_axfr_begin(emdns_ctx_t* ctx, emdns_axfr_t* axfr, char* request_buffer, uint16_t request_len) {
+    char* zone;
+    uint16_t type, class;
+
+    if (request_len < sizeof (dns_header_t) || _header_get(request_buffer, HEADER_QDCOUNT) != 1) {
+        return -1;
+    }
+    if (_read_question(request_buffer + sizeof (dns_header_t), request_len - sizeof (dns_header_t),
+        &zone, &type, &class) != 0 || type != RecordAXFR) {
+        return -1;
+    }
+    // the zone outlives the request
+    strcpy(axfr->zone, zone);
+
+    axfr->ctx = ctx;
+    memcpy(&axfr->id, request_buffer, sizeof (axfr->id));
+    axfr->record_class = class;
+    axfr->cursor = ctx->records;
+    axfr->generate = ctx->generates;
+    axfr->generate_value = (ctx->generates != 0 ? ctx->generates->start : 0);
+    axfr->comp_count = 0;
+    axfr->zone_name = names_lookup(&ctx->names, axfr->zone);
+    axfr->soa = _find_record(ctx, axfr->zone_name, RecordSOA, class, ctx->records);
+
+    if (axfr->soa == 0) {
+        // not authoritative for this zone
+        axfr->stage = AxfrError;
+        axfr->rcode = FlagErrNotAuth;
+    }
+    else {
+        axfr->stage = AxfrLeadingSoa;
+    }
+
+#ifdef EMDNS_ENABLE_LOGGING
+    printf("Zone transfer requested.\n");
+#endif
+    return 0;
+}
+
+int emdns_axfr_next(emdns_axfr_t* axfr, char* buffer, uint16_t buffer_max, uint16_t* message_len) {
+    emdns_ctx_t* ctx = axfr->ctx;
+    if (axfr->stage == AxfrDone) {
+        return 0;
+    }
+    // there has to be space at least for the question
+    if (buffer_max < sizeof (uint16_t) + sizeof (dns_header_t) + strlen(axfr->zone) + 1 + 4) {
+        return -1;
+    }
+
+    char* message = buffer + sizeof (uint16_t);
+    char* end = buffer + buffer_max;
+    char* p = message + sizeof (dns_header_t);
+    uint16_t flags = FlagQR | FlagAA;
+    uint16_t ancount = 0;
+    emdns_change_t change;
+    char domain[256];
+    char rdata[EMDNS_RDATA_MAX];
+
+    memcpy(message, &axfr->id, sizeof (axfr->id));
+    _header_set(message, HEADER_QDCOUNT, 0);
+    _header_set(message, HEADER_NSCOUNT, 0);
+    _header_set(message, HEADER_ARCOUNT, 0);
+    axfr->comp_count = 0;
+
+    if (axfr->stage == AxfrLeadingSoa || axfr->stage == AxfrError) {
+        // first message repeats the question
+        _axfr_pack_name(axfr, message, &p, axfr->zone);
+        PACK16(p, htons(RecordAXFR));
+        PACK16(p, htons(axfr->record_class));
+        _header_set(message, HEADER_QDCOUNT, 1);
+    }
+
+    if (axfr->stage == AxfrError) {
+        flags |= axfr->rcode;
+        axfr->stage = AxfrDone;
+    }
+
+    while (axfr->stage != AxfrDone) {
+        emdns_change_t* record;
+        if (axfr->stage == AxfrRecords || axfr->stage == AxfrGenerated) {
+            record = _axfr_next_record(axfr, &change, domain, rdata);
+            if (record == 0) {
+                axfr->stage = AxfrTrailingSoa;
+                continue;
+            }
+        }
+        else {
+            record = _record_change(ctx, axfr->soa, &change, rdata);
+            record->domain = axfr->zone;
+        }
+
+        if (!_axfr_pack_record(axfr, message, &p, end, record)) {
+            // message is full, continue with this record in the next one
+            break;
+        }
+        ancount++;
+
+        if (axfr->stage == AxfrLeadingSoa) {
+            axfr->stage = AxfrRecords;
+        }
+        else if (axfr->stage == AxfrTrailingSoa) {
+            axfr->stage = AxfrDone;
+        }
+        else if (axfr->stage == AxfrGenerated) {
+            _axfr_next_generated(axfr);
+        }
+        else {
+            axfr->cursor = axfr->cursor->next;
+        }
+    }
+
+    if (ancount == 0 && axfr->stage != AxfrDone) {
+        // a single record does not fit in the buffer
+        return -1;
+    }
+
+    _header_set(message, HEADER_FLAGS, flags);
+    _header_set(message, HEADER_ANCOUNT, ancount);
+    uint16_t len = p - message;
+    PACK16(buffer, htons(len));
+    *message_len = len + sizeof (uint16_t);
+    return 1;
+}
+
+/**
+ * Read the question of a request. The name is checked and left in the
+ * request, where its root label terminates it, so it is not copied per query.
+ *
+ * @param domain set to the name in the request
+ * @return 0 = success, -1 = the question is malformed
+ */
+static int _read_question(char* request_buffer, uint16_t request_len, char** domain, uint16_t* type, uint16_t* class) {
+    uint16_t pos = 0;
+    while (pos < request_len && request_buffer[pos] != '\0') {
+        uint8_t label = request_buffer[pos];
+        // compression is not allowed in the question, names are at most 255
+        if (label > 63 || pos + label + 1 >= request_len || pos + label + 1 > 254) {
+            return -1;
+        }
+        pos += label + 1;
+    }
+    if (pos + 5 > request_len) {
+        return -1;
+    }
+    *domain = request_buffer;
+
+    char* p = request_buffer + pos + 1;
+    UNPACK16_N2H(p, *type);
+    UNPACK16_N2H(p, *class);
+    return 0;
+}
+
+static char _in_zone(char* domain, char* zone) {
+    while (*domain != '\0') {
+        if (strcmp(domain, zone) == 0) {
+            return 1;
+        }
+        MOVE(domain, *domain + 1);
+    }
+    return *zone == '\0';
+}
+
+static emdns_change_t* _axfr_next_record(emdns_axfr_t* axfr, emdns_change_t* record, char* domain, char* rdata) {
+    emdns_ctx_t* ctx = axfr->ctx;
+    while (axfr->stage == AxfrRecords && axfr->cursor != 0) {
+        emdns_record_t* stored = axfr->cursor;
+        // the SOA record is sent only at the beginning and at the end
+        char is_soa = (_record_type(stored) == RecordSOA && stored->domain == axfr->zone_name);
+        if (!is_soa &&
+            _record_class(stored) == axfr->record_class &&
+            names_in_zone(&ctx->names, stored->domain, axfr->zone_name)) {
+            names_decode(&ctx->names, stored->domain, domain);
+            _record_change(ctx, stored, record, rdata);
+            record->domain = domain;
+            return record;
+        }
+        axfr->cursor = stored->next;
+    }
+    axfr->stage = AxfrGenerated;
+
+    // records of the templates are synthesized one by one
+    while (axfr->generate != 0) {
+        emdns_generate_t* generate = axfr->generate;
+        int length = -1;
+        if (generate->record_class == axfr->record_class) {
+            length = _generate_record(generate, axfr->generate_value, domain, rdata);
+        }
+        if (length >= 0 && _in_zone(domain, axfr->zone)) {
+            record->op = ChangeAdd;
+            record->domain = domain;
+            record->record_type = generate->record_type;
+            record->record_class = axfr->record_class;
+            record->ttl = generate->ttl;
+            record->rdata = rdata;
+            record->length = length;
+            return record;
+        }
+        // the template is of another class or zone, the domains differ only
+        // in the number, so the whole template is skipped
+        axfr->generate_value = generate->stop;
+        _axfr_next_generated(axfr);
+    }
+    return 0;
+}
+
+static void _axfr_next_generated(emdns_axfr_t* axfr) {
+    uint64_t value = (uint64_t) axfr->generate_value + axfr->generate->step;
+    if (value > axfr->generate->stop) {
+        axfr->generate = axfr->generate->next;
+        value = (axfr->generate != 0 ? axfr->generate->start : 0);
+    }
+    axfr->generate_value = value;
+}
+
+static void _axfr_pack_name(emdns_axfr_t* axfr, char* message, char** buffer, char* domain) {
+    emdns_ctx_t* ctx = axfr->ctx;
+    // only interned suffixes are remembered, the rest of the name is written
+    // as it is (names of synthesized records)
+    uint16_t prefix_len;
+    uint32_t suffix = names_lookup_suffix(&ctx->names, domain, &prefix_len);
+    memcpy(*buffer, domain, prefix_len);
+    MOVE(*buffer, prefix_len);
+
+    while (suffix != NAME_ROOT) {
+        for (uint8_t i = 0; i < axfr->comp_count; i++) {
+            if (axfr->comp_name[i] == suffix) {
+                // rest of the name is already in the message
+                PACK16(*buffer, htons(0xC000 | axfr->comp_offset[i]));
+                return;
+            }
+        }
+
+        uint16_t offset = *buffer - message;
+        if (axfr->comp_count < EMDNS_AXFR_COMPRESSION && offset < 0x4000) {
+            axfr->comp_name[axfr->comp_count] = suffix;
+            axfr->comp_offset[axfr->comp_count] = offset;
+            axfr->comp_count++;
+        }
+
+        char* label = names_label(&ctx->names, suffix);
+        memcpy(*buffer, label, *label + 1);
+        MOVE(*buffer, *label + 1);
+        suffix = names_parent(&ctx->names, suffix);
+    }
+    PACK8((*buffer), 0);
+}
+
+static char _axfr_pack_record(emdns_axfr_t* axfr, char* message, char** buffer, char* end, emdns_change_t* record) {
+    // check the uncompressed size, compression can only make it smaller
+    if (*buffer + strlen(record->domain) + 1 + 10 + record->length > end) {
+        return 0;
+    }
+
+    _axfr_pack_name(axfr, message, buffer, record->domain);
+    PACK16(*buffer, htons(record->record_type));
+    PACK16(*buffer, htons(record->record_class));
+    PACK32(*buffer, htonl(record->ttl));
+
+    char* rdlength = *buffer;
+    MOVE(*buffer, sizeof (uint16_t));
+    char* rdata = *buffer;
+
+    switch (record->record_type) {
+        case RecordCNAME:
+        case RecordNS:
+        case RecordPTR:
+            _axfr_pack_name(axfr, message, buffer, record->rdata);
+            break;
+
+        case RecordMX:
+            memcpy(*buffer, record->rdata, sizeof (uint16_t));
+            MOVE(*buffer, sizeof (uint16_t));
+            _axfr_pack_name(axfr, message, buffer, record->rdata + 2);
+            break;
+
+        case RecordSOA:
+        {
+            char* mail = record->rdata + strlen(record->rdata) + 1;
+            _axfr_pack_name(axfr, message, buffer, record->rdata);
+            _axfr_pack_name(axfr, message, buffer, mail);
+            memcpy(*buffer, mail + strlen(mail) + 1, 5 * sizeof (uint32_t));
+            MOVE(*buffer, 5 * sizeof (uint32_t));
+        }
+            break;
+
+        default:
+            memcpy(*buffer, record->rdata, record->length);
+            MOVE(*buffer, record->length);
+            break;
+    }
+
+    PACK16(rdlength, htons(*buffer - rdata));
+    return 1;
+}
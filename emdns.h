@@ -4,10 +4,78 @@
 #include "emsettings.h"
 #include "dns.h"
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
 /**
- * Add a record to the DNS zone.
+ * Maximum number of names remembered for compression within one zone
+ * transfer message. Names beyond this are written uncompressed.
+ */
+#define EMDNS_AXFR_COMPRESSION 64
+
+struct emdns_record_t;
+struct emdns_generate_t;
+
+/**
+ * A store of records. Each context is independent of all others, so several
+ * zones, views or per-core shards can be served by one process. Answering
+ * queries only reads a context, so several threads may answer queries from
+ * the same context, but records must only be changed, including by dynamic
+ * updates, while no other thread uses the context.
+ */
+typedef struct emdns_ctx_t emdns_ctx_t;
+
+/**
+ * Options of a context.
+ */
+typedef enum {
+    OptionAllClasses = 0x1, ///< support all classes, otherwise only IN is used
+    OptionFullAny = 0x2,    ///< answer ANY queries with all records, otherwise minimal (RFC 8482)
+    OptionRotate = 0x4,     ///< rotate the records of RRsets, round-robin
+    OptionRotateRandom = 0x8 ///< rotate the records of RRsets, starting at a random record
+} emdns_option_t;
+
+/**
+ * State of an outbound zone transfer (AXFR). The transfer is encoded message
+ * by message directly from the record store, the zone is never copied. The
+ * store must not be modified while a transfer is in progress.
+ */
+typedef struct {
+    emdns_ctx_t* ctx;
+    char zone[256];
+    uint32_t zone_name;
+    uint16_t id;
+    dns_class_t record_class;
+    uint16_t rcode;
+    uint8_t stage;
+    struct emdns_record_t* soa;
+    struct emdns_record_t* cursor;
+    struct emdns_generate_t* generate;
+    uint32_t generate_value;
+    // compression table of the message currently being encoded
+    uint32_t comp_name[EMDNS_AXFR_COMPRESSION];
+    uint16_t comp_offset[EMDNS_AXFR_COMPRESSION];
+    uint8_t comp_count;
+}
+emdns_axfr_t;
+
+/**
+ * Create an empty context.
+ * 
+ * @param options options of the context, see emdns_option_t
+ * @return the context, 0 if there is not enough memory
+ */
+emdns_ctx_t* emdns_ctx_new(uint32_t options);
+
+/**
+ * Free a context and all its records.
+ * 
+ * @param ctx the context
+ */
+void emdns_ctx_free(emdns_ctx_t* ctx);
+
+/**
+ * Add a record to the DNS zone. Unless the context supports all classes, the
+ * class has to be IN.
  * 
+ * @param ctx the context
  * @param domain domain name
  * @param record_type record type
  * @param record_class record class
@@ -15,53 +83,177 @@
  * @param ttl time to live in seconds
  * @return 0 = success, everything else is an error code
  */
-int emdns_add_record(char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl);
-#else
+int emdns_add_record(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl);
+
 /**
- * Add a record to the DNS zone.
+ * Add a range of records to the DNS zone, as the $GENERATE directive of BIND
+ * does. In the domain and the response, $ is replaced by the value of the
+ * iterator, ${offset,width,base} can be used to modify it (base is one of d,
+ * o, x and X). If $ appears only once in the domain, the records are not
+ * created but synthesized from the templates when they are queried.
  * 
- * @param domain domain name
+ * @param ctx the context
+ * @param start first value of the iterator
+ * @param stop last value of the iterator
+ * @param step increment of the iterator
+ * @param domain domain name template
  * @param record_type record type
- * @param response response to return
+ * @param record_class record class
+ * @param response response template
  * @param ttl time to live in seconds
  * @return 0 = success, everything else is an error code
  */
-int emdns_add_record(char* domain, dns_record_t record_type, char* response, uint32_t ttl);
-#endif
+int emdns_add_generate(emdns_ctx_t* ctx, uint32_t start, uint32_t stop, uint32_t step, char* domain, dns_record_t record_type, dns_class_t record_class, char* response, uint32_t ttl);
 
-#ifdef EMDNS_SUPPORT_ALL_CLASSES
 /**
  * Remove records from the DNS zone. Will remove all entries of this type. 
  * 
+ * @param ctx the context
  * @param domain domain name
  * @param record_type the record type
  * @param record_class record class
  * @return returns the number of entries removed
  */
-int emdns_remove_record(char* domain, dns_record_t record_type, dns_class_t record_class);
-#else
-/**
- * Remove records from the DNS zone. Will remove all entries of this type. 
- * 
- * @param domain domain name
- * @param record_type the record type
- * @return returns the number of entries removed
- */
-int emdns_remove_record(char* domain, dns_record_t record_type);
-#endif
+int emdns_remove_record(emdns_ctx_t* ctx, char* domain, dns_record_t record_type, dns_class_t record_class);
 
 /**
  * Resolve a DNS entry based on the DNS query in request_buffer. Pass the query
  * in a row format as it is received via the network without any modifications.
  * This function will return the answer of the DNS query in answer_buffer, its
  * length will be answer_len. The answer can be sent directly via the network.
+ * Dynamic updates (RFC 2136) are applied as well, if an update hook is set.
+ * Malformed questions are answered with FORMERR, answers which do not fit
+ * into the response buffer are cut off and have the TC flag set.
  * 
+ * @param ctx the context
  * @param request_buffer the request as received via the network
+ * @param request_len length of the request
  * @param answer_buffer response will be prepared here
  * @param response_max buffer size of response buffer
- * @param answer_len this is the real size of the response
+ * @param answer_len this is the real size of the response, 0 if the request is
+ *        too short to be answered
+ */
+void emdns_resolve_raw(emdns_ctx_t* ctx, char* request_buffer, uint16_t request_len, char* answer_buffer, uint16_t response_max, uint16_t* answer_len);
+
+/**
+ * Kinds of changes to the records.
+ */
+typedef enum {
+    ChangeAdd = 1,          ///< add a record
+    ChangeDeleteRecord = 2, ///< delete the record with the same rdata
+    ChangeDeleteRRset = 3,  ///< delete all records of the type
+    ChangeDeleteName = 4,   ///< delete all records of the domain
+    ChangeGenerate = 5      ///< add a template of emdns_add_generate
+} emdns_change_op_t;
+
+/**
+ * A single change of the records. Domain is in DNS format (length prefixed
+ * labels) and rdata in uncompressed wire format. For ChangeGenerate, domain is
+ * the domain template and rdata contains start, stop and step (32 bit, network
+ * byte order) followed by the response template.
+ */
+typedef struct {
+    emdns_change_op_t op;
+    char* domain;
+    dns_record_t record_type;
+    dns_class_t record_class;
+    uint32_t ttl;
+    char* rdata;
+    uint16_t length;
+}
+emdns_change_t;
+
+/**
+ * Called for every change made by a dynamic update, after it was applied.
+ * Changes are either additions (ChangeAdd) or removals of single records
+ * (ChangeDeleteRecord), so they can be undone by applying the inverse change.
+ */
+typedef void (*emdns_update_hook_t)(emdns_change_t* change);
+
+/**
+ * Called for every record by emdns_foreach_record.
+ */
+typedef void (*emdns_record_callback_t)(emdns_change_t* record, void* arg);
+
+/**
+ * Apply a change to the records, e.g. when replaying a journal. The update
+ * hook is not called.
+ * 
+ * @param ctx the context
+ * @param change the change to apply
+ * @return 0 = success, everything else is an error code
+ */
+int emdns_apply_change(emdns_ctx_t* ctx, emdns_change_t* change);
+
+/**
+ * Enable dynamic updates. Update requests are refused until a hook is set,
+ * which will be called for every applied change, e.g. to persist it. Pass 0
+ * to disable dynamic updates again.
+ * 
+ * @param ctx the context
+ * @param hook function called for every applied change
+ */
+void emdns_set_update_hook(emdns_ctx_t* ctx, emdns_update_hook_t hook);
+
+/**
+ * Call a function for every record. The record is passed as a ChangeAdd
+ * change, which can be passed to emdns_apply_change to recreate it. Templates
+ * of synthesized records are passed as ChangeGenerate changes.
+ * 
+ * @param ctx the context
+ * @param callback function to call
+ * @param arg argument passed to the callback
+ */
+void emdns_foreach_record(emdns_ctx_t* ctx, emdns_record_callback_t callback, void* arg);
+
+/**
+ * Prepare an outbound zone transfer for the AXFR query in request_buffer. If
+ * the zone is unknown, the transfer will consist of a single error response.
+ * 
+ * @param ctx the context
+ * @param axfr transfer state to initialize
+ * @param request_buffer the request as received via the network (without the
+ *        TCP length prefix)
+ * @param request_len length of the request
+ * @return 0 = transfer prepared, -1 = the request is not a zone transfer
+ */
+int emdns_axfr_begin(emdns_ctx_t* ctx, emdns_axfr_t* axfr, char* request_buffer, uint16_t request_len);
+
+/**
+ * Encode the next message of a zone transfer. As many records as fit are
+ * packed into each message, with name compression. The message is prefixed
+ * by its 2 byte length, so the buffer can be written to the TCP connection
+ * as it is. The buffer can be reused for every message of the transfer.
+ * 
+ * @param axfr transfer state prepared by emdns_axfr_begin
+ * @param buffer message will be prepared here
+ * @param buffer_max buffer size
+ * @param message_len this is the real size of the message including prefix
+ * @return 1 = message written, 0 = transfer finished, -1 = buffer too small
+ */
+int emdns_axfr_next(emdns_axfr_t* axfr, char* buffer, uint16_t buffer_max, uint16_t* message_len);
+
+/**
+ * Memory used by the records.
+ */
+typedef struct {
+    uint32_t records;             ///< number of records
+    uint64_t record_bytes;        ///< records including their rdata
+    uint64_t encoded_bytes;       ///< records encoded for ANY queries and rotated answers
+    uint32_t names;               ///< number of interned labels
+    uint64_t name_bytes;          ///< memory used by the interned names
+    uint64_t name_bytes_unshared; ///< memory the names would use if not shared
+}
+emdns_memory_t;
+
+/**
+ * Report the memory used by the records. Domain names, including the names in
+ * rdata, are interned and share their common suffixes.
+ * 
+ * @param ctx the context
+ * @param usage the report will be stored here
  */
-void emdns_resolve_raw(char* request_buffer, char* answer_buffer, uint16_t response_max, uint16_t* answer_len);
+void emdns_memory_usage(emdns_ctx_t* ctx, emdns_memory_t* usage);
 
 #endif /* EMDNS_H */
 
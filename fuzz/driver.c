@@ -0,0 +1,98 @@
+/*
+ * Standalone driver for the fuzz targets, used when they are not linked with
+ * libFuzzer. Every argument is a file, or a directory of files, which is
+ * passed to the target as one input. Without arguments the input is read
+ * from stdin. This replays corpora and crashes, and works with AFL, e.g.
+ *   afl-fuzz -i fuzz/corpus/resolve -o findings -- build/sanitize/fuzz_resolve @@
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "dirent.h"
+#include "sys/stat.h"
+
+#define DRIVER_INPUT_MAX (1 << 20)
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/**
+ * Declaration of all helper functions.
+ */
+static int _run_stream(FILE* stream);
+static int _run_file(char* path);
+static int _run_path(char* path);
+
+/**
+ * Definition of all helper functions.
+ */
+static int _run_stream(FILE* stream) {
+    uint8_t* data = malloc(DRIVER_INPUT_MAX);
+    if (data == 0) {
+        return -1;
+    }
+    size_t size = fread(data, 1, DRIVER_INPUT_MAX, stream);
+    // exactly the input, so reads behind it are detected by the sanitizers
+    uint8_t* input = malloc(size > 0 ? size : 1);
+    if (input == 0) {
+        free(data);
+        return -1;
+    }
+    memcpy(input, data, size);
+    free(data);
+    LLVMFuzzerTestOneInput(input, size);
+    free(input);
+    return 0;
+}
+
+static int _run_file(char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == 0) {
+        perror(path);
+        return -1;
+    }
+    int res = _run_stream(f);
+    fclose(f);
+    return res;
+}
+
+static int _run_path(char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return _run_file(path);
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == 0) {
+        perror(path);
+        return -1;
+    }
+    int res = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != 0 && res == 0) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char file[4096];
+        snprintf(file, sizeof (file), "%s/%s", path, entry->d_name);
+        res = _run_path(file);
+    }
+    closedir(dir);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        return _run_stream(stdin) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (_run_path(argv[i]) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
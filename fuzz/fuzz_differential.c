@@ -0,0 +1,428 @@
+/*
+ * Differential fuzz target: every query is answered by the lookup engine,
+ * once in order and once with the RRsets rotated from their encoded buffers,
+ * and by the simple reference implementation below, which scans a plain
+ * array of the records. The templates the engine synthesizes records from
+ * are expanded into the array, so synthesized names are compared as well.
+ * The answers have to contain the same records, in any order, with the same
+ * response code. The process aborts on the first difference, so it is
+ * reported by the fuzzer with the query as input.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "arpa/inet.h"
+#include "../emdns.h"
+#include "fuzz_zone.h"
+
+#define REFERENCE_RECORDS_MAX 256
+#define REFERENCE_ALIAS_MAX 8
+#define ANSWERS_MAX 64
+
+typedef struct {
+    char domain[256];
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t length;
+    char rdata[512];
+} reference_record_t;
+
+typedef struct {
+    reference_record_t records[REFERENCE_RECORDS_MAX];
+    uint16_t count;
+} reference_t;
+
+typedef struct {
+    uint16_t rcode;
+    uint16_t count;
+    reference_record_t* answers[ANSWERS_MAX];
+} expected_t;
+
+static reference_t reference;
+static emdns_ctx_t* contexts[2] = {0, 0};
+
+/**
+ * Declaration of all helper functions.
+ */
+static void _collect(emdns_change_t* record, void* arg);
+static void _expand_template(emdns_change_t* template);
+static int _expand(const char* template, uint32_t value, char* out, size_t max);
+static int _read_question(const uint8_t* data, size_t size, char* domain, uint16_t* type, uint16_t* class);
+static void _expect(char* domain, uint16_t type, uint16_t class, expected_t* expected);
+static void _expect_any(char* domain, uint16_t class, expected_t* expected);
+static int _read_name(char* message, uint16_t len, uint16_t* pos, char* name);
+static void _compare(char* response, uint16_t answer_len, expected_t* expected, char any);
+static void _fail(char* reason);
+
+/**
+ * Definition of all helper functions.
+ */
+static void _collect(emdns_change_t* record, void* arg) {
+    (void) arg;
+    if (record->op == ChangeGenerate) {
+        _expand_template(record);
+        return;
+    }
+    if (record->op != ChangeAdd || reference.count == REFERENCE_RECORDS_MAX ||
+        record->length > sizeof (reference.records[0].rdata)) {
+        _fail("the fuzz zone does not fit into the reference");
+    }
+    reference_record_t* entry = &reference.records[reference.count++];
+    strcpy(entry->domain, record->domain);
+    entry->type = record->record_type;
+    entry->class = record->record_class;
+    entry->ttl = record->ttl;
+    entry->length = record->length;
+    memcpy(entry->rdata, record->rdata, record->length);
+}
+
+/**
+ * Add all records of a template, every value is expanded on its own and the
+ * records are converted to wire format by a context of their own.
+ */
+static void _expand_template(emdns_change_t* template) {
+    uint32_t range[3];
+    char response_template[256];
+    uint16_t response_len = template->length - sizeof (range);
+    memcpy(range, template->rdata, sizeof (range));
+    memcpy(response_template, template->rdata + sizeof (range), response_len);
+    response_template[response_len] = '\0';
+
+    emdns_ctx_t* expanded = emdns_ctx_new(OptionAllClasses);
+    for (uint32_t value = ntohl(range[0]); expanded != 0 && value <= ntohl(range[1]); value += ntohl(range[2])) {
+        char domain[256];
+        char response[256];
+        if (_expand(template->domain, value, domain, sizeof (domain)) != 0 ||
+            _expand(response_template, value, response, sizeof (response)) != 0 ||
+            emdns_add_record(expanded, domain, template->record_type, template->record_class, response,
+            template->ttl) != 0) {
+            _fail("a template of the fuzz zone does not expand");
+        }
+    }
+    if (expanded == 0) {
+        _fail("a template of the fuzz zone does not expand");
+    }
+    emdns_foreach_record(expanded, _collect, 0);
+    emdns_ctx_free(expanded);
+}
+
+/**
+ * Expand a template for a value: $ is the value, ${offset,width,base}
+ * modifies it and \$ is a $.
+ *
+ * @return 0 = success, -1 = invalid template or the result is too long
+ */
+static int _expand(const char* template, uint32_t value, char* out, size_t max) {
+    size_t len = 0;
+    out[0] = '\0';
+    while (*template != '\0') {
+        char part[32] = {*template, '\0'};
+        if (template[0] == '\\' && template[1] == '$') {
+            part[0] = '$';
+            template += 2;
+        }
+        else if (*template == '$') {
+            long offset = 0, width = 0;
+            char base = 'd';
+            char* end = (char*) template + 1;
+            if (*end == '{') {
+                offset = strtol(end + 1, &end, 10);
+                if (*end == ',') {
+                    width = strtol(end + 1, &end, 10);
+                }
+                if (*end == ',') {
+                    base = end[1];
+                    end += 2;
+                }
+                if (*end != '}' || width < 0 || width > 10) {
+                    return -1;
+                }
+                end++;
+            }
+            template = end;
+            long long number = (long long) value + offset;
+            if (number < 0 || base == 'd') {
+                snprintf(part, sizeof (part), "%0*lld", (int) width, number);
+            }
+            else if (base == 'o' || base == 'x' || base == 'X') {
+                snprintf(part, sizeof (part), base == 'o' ? "%0*llo" : (base == 'x' ? "%0*llx" : "%0*llX"),
+                    (int) width, (unsigned long long) number);
+            }
+            else {
+                return -1;
+            }
+        }
+        else {
+            template++;
+        }
+        size_t part_len = strlen(part);
+        if (len + part_len >= max) {
+            return -1;
+        }
+        memcpy(out + len, part, part_len + 1);
+        len += part_len;
+    }
+    return 0;
+}
+
+/**
+ * The question as RFC 1035 defines it: labels of up to 63 characters, at
+ * most 255 characters and no compression.
+ *
+ * @return 0 = success, -1 = malformed
+ */
+static int _read_question(const uint8_t* data, size_t size, char* domain, uint16_t* type, uint16_t* class) {
+    size_t pos = 12;
+    while (1) {
+        if (pos >= size) {
+            return -1;
+        }
+        uint8_t label = data[pos];
+        if (label == 0) {
+            break;
+        }
+        if (label > 63 || pos - 12 + label + 1 > 254) {
+            return -1;
+        }
+        pos += label + 1;
+    }
+    if (pos + 5 > size) {
+        return -1;
+    }
+    memcpy(domain, data + 12, pos - 12 + 1);
+    *type = (data[pos + 1] << 8) | data[pos + 2];
+    *class = (data[pos + 3] << 8) | data[pos + 4];
+    return 0;
+}
+
+/**
+ * All records of the type, following CNAME records unless they are queried.
+ */
+static void _expect(char* domain, uint16_t type, uint16_t class, expected_t* expected) {
+    uint8_t aliases = 0;
+    expected->count = 0;
+    while (1) {
+        reference_record_t* alias = 0;
+        for (uint16_t i = 0; i < reference.count; i++) {
+            reference_record_t* record = &reference.records[i];
+            if (record->class != class || strcmp(record->domain, domain) != 0) {
+                continue;
+            }
+            if (record->type == type) {
+                expected->answers[expected->count++] = record;
+            }
+            else if (record->type == RecordCNAME && alias == 0) {
+                alias = record;
+            }
+        }
+        if (type == RecordCNAME || alias == 0 || aliases++ == REFERENCE_ALIAS_MAX) {
+            break;
+        }
+        expected->answers[expected->count++] = alias;
+        domain = alias->rdata;
+    }
+    expected->rcode = (expected->count == 0 ? FlagErrName : FlagNoError);
+}
+
+/**
+ * All records of the name, the RRset which is returned is checked later.
+ */
+static void _expect_any(char* domain, uint16_t class, expected_t* expected) {
+    expected->count = 0;
+    for (uint16_t i = 0; i < reference.count; i++) {
+        if (reference.records[i].class == class && strcmp(reference.records[i].domain, domain) == 0) {
+            expected->answers[expected->count++] = &reference.records[i];
+        }
+    }
+    expected->rcode = (expected->count == 0 ? FlagErrName : FlagNoError);
+}
+
+/**
+ * Read a possibly compressed name.
+ *
+ * @return 0 = success, -1 = malformed
+ */
+static int _read_name(char* message, uint16_t len, uint16_t* pos, char* name) {
+    uint16_t p = *pos;
+    uint16_t name_len = 0;
+    uint8_t jumps = 0;
+    char jumped = 0;
+    while (1) {
+        if (p >= len) {
+            return -1;
+        }
+        uint8_t label = message[p];
+        if ((label & 0xC0) == 0xC0) {
+            if (p + 1 >= len || ++jumps > 16) {
+                return -1;
+            }
+            if (!jumped) {
+                *pos = p + 2;
+                jumped = 1;
+            }
+            p = ((label & 0x3F) << 8) | (uint8_t) message[p + 1];
+            continue;
+        }
+        if (label > 63 || p + label + 1 > len || name_len + label + 1 > 255) {
+            return -1;
+        }
+        memcpy(name + name_len, message + p, label + 1);
+        name_len += label + 1;
+        p += label + 1;
+        if (label == 0) {
+            break;
+        }
+    }
+    if (!jumped) {
+        *pos = p;
+    }
+    return 0;
+}
+
+/**
+ * Check the response against the expected records. For ANY queries, the
+ * answer has to be the smallest RRset of the name.
+ */
+static void _compare(char* response, uint16_t answer_len, expected_t* expected, char any) {
+    if (answer_len < 12) {
+        _fail("no header");
+    }
+    uint16_t flags = ((uint8_t) response[2] << 8) | (uint8_t) response[3];
+    uint16_t ancount = ((uint8_t) response[6] << 8) | (uint8_t) response[7];
+    if ((flags & 0x000F) != expected->rcode || (flags & FlagTC)) {
+        _fail("response code");
+    }
+
+    char matched[ANSWERS_MAX] = {0};
+    uint16_t pos = 12;
+    uint16_t answer_type = 0;
+    for (uint16_t i = 0; i < ancount; i++) {
+        char owner[256];
+        if (_read_name(response, answer_len, &pos, owner) != 0 || pos + 10 > answer_len) {
+            _fail("malformed answer");
+        }
+        uint16_t type = ((uint8_t) response[pos] << 8) | (uint8_t) response[pos + 1];
+        uint16_t class = ((uint8_t) response[pos + 2] << 8) | (uint8_t) response[pos + 3];
+        uint32_t ttl;
+        uint16_t length = ((uint8_t) response[pos + 8] << 8) | (uint8_t) response[pos + 9];
+        memcpy(&ttl, response + pos + 4, 4);
+        ttl = ntohl(ttl);
+        pos += 10;
+        if (pos + length > answer_len) {
+            _fail("malformed answer");
+        }
+
+        uint16_t j = 0;
+        for (; j < expected->count; j++) {
+            reference_record_t* record = expected->answers[j];
+            if (!matched[j] && strcmp(record->domain, owner) == 0 && record->type == type &&
+                record->class == class && record->ttl == ttl && record->length == length &&
+                memcmp(record->rdata, response + pos, length) == 0) {
+                matched[j] = 1;
+                break;
+            }
+        }
+        if (j == expected->count) {
+            _fail("unexpected record");
+        }
+        if (any && answer_type != 0 && type != answer_type) {
+            _fail("more than one RRset");
+        }
+        answer_type = type;
+        pos += length;
+    }
+
+    if (!any) {
+        if (ancount != expected->count) {
+            _fail("missing record");
+        }
+        return;
+    }
+    if (expected->count == 0) {
+        return;
+    }
+
+    // the whole RRset, and none of the other RRsets of the name is smaller
+    uint32_t sizes[ANSWERS_MAX] = {0};
+    uint32_t answer_size = 0;
+    for (uint16_t j = 0; j < expected->count; j++) {
+        reference_record_t* record = expected->answers[j];
+        if (record->type == answer_type && !matched[j]) {
+            _fail("incomplete RRset");
+        }
+        for (uint16_t k = 0; k < expected->count; k++) {
+            if (expected->answers[k]->type == record->type) {
+                sizes[k] += 12 + record->length;
+                break;
+            }
+        }
+        if (record->type == answer_type) {
+            answer_size += 12 + record->length;
+        }
+    }
+    for (uint16_t j = 0; j < expected->count; j++) {
+        if (sizes[j] != 0 && sizes[j] < answer_size) {
+            _fail("not the smallest RRset");
+        }
+    }
+}
+
+static void _fail(char* reason) {
+    fprintf(stderr, "Difference to the reference: %s\n", reason);
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (contexts[0] == 0) {
+        contexts[0] = fuzz_zone_new(0, 1);
+        contexts[1] = fuzz_zone_new(OptionRotate, 1);
+        if (contexts[0] == 0 || contexts[1] == 0) {
+            abort();
+        }
+        emdns_foreach_record(contexts[0], _collect, 0);
+    }
+    // queries only, the reference does not apply updates
+    if (size > 0xFFFF || (size >= 4 && (((data[2] << 8) | data[3]) & FlagOpMask) != FlagOpQuery)) {
+        return 0;
+    }
+
+    char domain[256];
+    uint16_t type, class;
+    expected_t expected;
+    char valid = (_read_question(data, size, domain, &type, &class) == 0);
+    if (valid && type == RecordANY) {
+        _expect_any(domain, class, &expected);
+    }
+    else if (valid) {
+        _expect(domain, type, class, &expected);
+    }
+
+    char* request = malloc(size > 0 ? size : 1);
+    if (request == 0) {
+        return 0;
+    }
+    memcpy(request, data, size);
+    for (uint8_t i = 0; i < 2; i++) {
+        char response[4096];
+        uint16_t answer_len = 0;
+        emdns_resolve_raw(contexts[i], request, size, response, sizeof (response), &answer_len);
+        if (size < 12) {
+            if (answer_len != 0) {
+                _fail("answer without a header");
+            }
+        }
+        else if (!valid) {
+            uint16_t flags = ((uint8_t) response[2] << 8) | (uint8_t) response[3];
+            if (answer_len != 12 || (flags & 0x000F) != FlagErrFormat) {
+                _fail("malformed question accepted");
+            }
+        }
+        else {
+            _compare(response, answer_len, &expected, type == RecordANY);
+        }
+    }
+    free(request);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Fuzz target for the master file parser. Every record parsed is queried
+ * afterwards, so that the records stored from untrusted input are encoded as
+ * well. $INCLUDE reads the files below from memory, see fopen.
+ */
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "inttypes.h"
+#include "dlfcn.h"
+#include "arpa/inet.h"
+#include "../emdns.h"
+#include "../masterfile.h"
+
+typedef struct {
+    const char* path;
+    const char* content;
+} included_file_t;
+
+/**
+ * The files $INCLUDE can read: records with a relative origin, and a file
+ * which includes itself until the depth limit is reached.
+ */
+static const included_file_t included_files[] = {
+    {"fuzz.inc",
+        "$TTL 300\n"
+        "www IN A 192.0.2.1\n"
+        "alias IN CNAME www\n"
+        "$ORIGIN sub\n"
+        "@ IN TXT \"included\"\n"
+        "$GENERATE 1-3 host-$ A 10.0.0.$\n"},
+    {"loop.inc", "$INCLUDE loop.inc\n"},
+};
+
+static char parsing = 0;
+
+/**
+ * Declaration of all helper functions.
+ */
+static void _query(emdns_change_t* record, void* arg);
+FILE* fopen(const char* path, const char* mode);
+
+/**
+ * Definition of all helper functions.
+ */
+static void _query(emdns_change_t* record, void* arg) {
+    emdns_ctx_t* ctx = arg;
+    if (record->op != ChangeAdd) {
+        return;
+    }
+    char request[12 + 256 + 4];
+    uint16_t domain_len = strlen(record->domain) + 1;
+    memset(request, 0, 12);
+    request[5] = 1;
+    memcpy(request + 12, record->domain, domain_len);
+    uint16_t type = htons(record->record_type), class = htons(record->record_class);
+    memcpy(request + 12 + domain_len, &type, 2);
+    memcpy(request + 12 + domain_len + 2, &class, 2);
+
+    char response[512];
+    uint16_t answer_len;
+    emdns_resolve_raw(ctx, request, 12 + domain_len + 4, response, sizeof (response), &answer_len);
+    if (answer_len > sizeof (response)) {
+        abort();
+    }
+}
+
+/**
+ * Replaces fopen of the C library, so while parsing, the input can only
+ * include the files above instead of anything on the file system. Otherwise,
+ * e.g. for the inputs read by the driver, files are opened as usual.
+ */
+FILE* fopen(const char* path, const char* mode) {
+    if (!parsing) {
+        FILE* (*libc_fopen)(const char*, const char*) = (FILE* (*)(const char*, const char*)) dlsym(RTLD_NEXT, "fopen");
+        return libc_fopen(path, mode);
+    }
+    for (size_t i = 0; i < sizeof (included_files) / sizeof (included_files[0]); i++) {
+        if (strcmp(path, included_files[i].path) == 0) {
+            return fmemopen((void*) included_files[i].content, strlen(included_files[i].content), mode);
+        }
+    }
+    errno = ENOENT;
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    FILE* stream = fmemopen((void*) data, size, "r");
+    emdns_ctx_t* ctx = emdns_ctx_new(OptionAllClasses);
+    if (stream != 0 && ctx != 0) {
+        parsing = 1;
+        masterfile_parse(ctx, stream);
+        parsing = 0;
+        emdns_foreach_record(ctx, _query, ctx);
+    }
+    if (stream != 0) {
+        fclose(stream);
+    }
+    if (ctx != 0) {
+        emdns_ctx_free(ctx);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Fuzz target for the packet parser: queries, dynamic updates and zone
+ * transfer requests, answered from a fixed zone.
+ */
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "../emdns.h"
+#include "fuzz_zone.h"
+
+static emdns_ctx_t* ctx = 0;
+static char changed = 0;
+
+/**
+ * Declaration of all helper functions.
+ */
+static void _hook(emdns_change_t* change);
+
+/**
+ * Definition of all helper functions.
+ */
+static void _hook(emdns_change_t* change) {
+    (void) change;
+    // applied updates are undone by reloading the zone before the next input
+    changed = 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size > 0xFFFF) {
+        return 0;
+    }
+    if (ctx == 0 || changed) {
+        if (ctx != 0) {
+            emdns_ctx_free(ctx);
+        }
+        ctx = fuzz_zone_new(OptionAllClasses | OptionFullAny, 1);
+        if (ctx == 0) {
+            abort();
+        }
+        emdns_set_update_hook(ctx, _hook);
+        changed = 0;
+    }
+
+    // the parser must not rely on anything behind the input
+    char* request = malloc(size > 0 ? size : 1);
+    if (request == 0) {
+        return 0;
+    }
+    memcpy(request, data, size);
+
+    // the size of a UDP response, so that truncation is reached as well
+    char response[512];
+    uint16_t answer_len = 0;
+    emdns_resolve_raw(ctx, request, size, response, sizeof (response), &answer_len);
+    if (answer_len > sizeof (response)) {
+        abort();
+    }
+
+    emdns_axfr_t axfr;
+    if (emdns_axfr_begin(ctx, &axfr, request, size) == 0) {
+        char message[4096];
+        uint16_t message_len;
+        while (emdns_axfr_next(&axfr, message, sizeof (message), &message_len) > 0) {
+            if (message_len > sizeof (message)) {
+                abort();
+            }
+        }
+    }
+
+    free(request);
+    return 0;
+}
@@ -0,0 +1,74 @@
+
+#ifndef FUZZ_ZONE_H
+#define FUZZ_ZONE_H
+
+#include "stdio.h"
+#include "string.h"
+#include "../emdns.h"
+#include "../masterfile.h"
+
+/**
+ * Zone the queries of the fuzz targets are resolved against, with every
+ * supported type, an RRset, CNAME chains and a loop.
+ */
+static const char FUZZ_ZONE[] =
+    "$ORIGIN fuzz.test.\n"
+    "$TTL 300\n"
+    "@ IN SOA ns1.fuzz.test. admin.fuzz.test. ( 1 3600 900 604800 300 )\n"
+    "@ IN NS ns1.fuzz.test.\n"
+    "@ IN NS ns2\n"
+    "@ IN MX 10 mail.fuzz.test.\n"
+    "@ IN MX 20 mail2\n"
+    "@ IN TXT \"v=spf1 mx -all\"\n"
+    "@ IN A 192.0.2.1\n"
+    "ns1 IN A 192.0.2.2\n"
+    "ns2 IN A 192.0.2.3\n"
+    "mail 3600 IN A 192.0.2.4\n"
+    "www IN A 198.51.100.1\n"
+    "www IN A 198.51.100.2\n"
+    "www IN A 198.51.100.3\n"
+    "alias IN CNAME www\n"
+    "chain IN CNAME alias\n"
+    "loop1 IN CNAME loop2\n"
+    "loop2 IN CNAME loop1\n"
+    "4.3.2.1.in-addr.arpa. IN PTR www.fuzz.test.\n"
+    "$GENERATE 1-4 eager$-$ TXT \"eager $\"\n";
+
+/**
+ * Templates which are not expanded, their records are synthesized when they
+ * are queried.
+ */
+static const char FUZZ_ZONE_TEMPLATES[] =
+    "$ORIGIN fuzz.test.\n"
+    "$GENERATE 1-100 host-$ A 10.0.0.$\n"
+    "$GENERATE 1-20/2 ${10,3,x}.rev CNAME www\n";
+
+static inline int fuzz_zone_parse(emdns_ctx_t* ctx, const char* zone) {
+    FILE* stream = fmemopen((void*) zone, strlen(zone), "r");
+    if (stream == 0) {
+        return -1;
+    }
+    int res = (masterfile_parse(ctx, stream) > 0 ? 0 : -1);
+    fclose(stream);
+    return res;
+}
+
+/**
+ * @param templates 1 = add FUZZ_ZONE_TEMPLATES as well
+ * @return context with the records of FUZZ_ZONE, 0 on error
+ */
+static inline emdns_ctx_t* fuzz_zone_new(uint32_t options, char templates) {
+    emdns_ctx_t* ctx = emdns_ctx_new(options);
+    if (ctx == 0 || fuzz_zone_parse(ctx, FUZZ_ZONE) != 0 ||
+        (templates && fuzz_zone_parse(ctx, FUZZ_ZONE_TEMPLATES) != 0)) {
+        fprintf(stderr, "Error: could not load the fuzz zone.\n");
+        if (ctx != 0) {
+            emdns_ctx_free(ctx);
+        }
+        return 0;
+    }
+    return ctx;
+}
+
+#endif /* FUZZ_ZONE_H */
+
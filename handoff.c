@@ -0,0 +1,182 @@
+/*
+ * Socket handoff between server processes.
+ *
+ * The running server sends a single message with the sockets attached and
+ * the following data (in network byte order):
+ *   magic (4) journal offset (8)
+ * The successor answers with the magic once it is serving.
+ */
+#include "handoff.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "sys/time.h"
+#include "arpa/inet.h"
+
+static const char HANDOFF_MAGIC[4] = {'E', 'M', 'H', '1'};
+
+/**
+ * Declaration of all helper functions.
+ */
+static int _address(char* path, struct sockaddr_un* addr);
+static void _close_received(struct msghdr* msg);
+
+/**
+ * Definition of all helper functions.
+ */
+static int _address(char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof (addr->sun_path)) {
+        return -1;
+    }
+    memset(addr, 0, sizeof (struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void _close_received(struct msghdr* msg) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != 0; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof (int), sizeof (int));
+                close(fd);
+            }
+        }
+    }
+}
+
+int handoff_listen(char* path) {
+    struct sockaddr_un addr;
+    if (_address(path, &addr) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *) &addr, sizeof (addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_take(char* path, int* fds, uint8_t count, uint64_t* offset) {
+    struct sockaddr_un addr;
+    if (count > HANDOFF_SOCKETS_MAX || _address(path, &addr) != 0) {
+        return -1;
+    }
+    int connfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connfd < 0) {
+        return -1;
+    }
+    if (connect(connfd, (const struct sockaddr *) &addr, sizeof (addr)) < 0) {
+        // no server running
+        close(connfd);
+        return -1;
+    }
+
+    char data[sizeof (HANDOFF_MAGIC) + 8];
+    char control[CMSG_SPACE(HANDOFF_SOCKETS_MAX * sizeof (int))];
+    struct iovec iov = {data, sizeof (data)};
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof (control)
+    };
+    ssize_t n = recvmsg(connfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        close(connfd);
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof (data) || memcmp(data, HANDOFF_MAGIC, sizeof (HANDOFF_MAGIC)) != 0 ||
+        (msg.msg_flags & MSG_CTRUNC) ||
+        cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(count * sizeof (int))) {
+        // sockets that were passed anyway must not leak
+        _close_received(&msg);
+        close(connfd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof (int));
+
+    uint32_t offset_high, offset_low;
+    memcpy(&offset_high, data + 4, 4);
+    memcpy(&offset_low, data + 8, 4);
+    *offset = ((uint64_t) ntohl(offset_high) << 32) | ntohl(offset_low);
+    return connfd;
+}
+
+int handoff_ready(int connfd) {
+    int res = (send(connfd, HANDOFF_MAGIC, sizeof (HANDOFF_MAGIC), MSG_NOSIGNAL) == sizeof (HANDOFF_MAGIC) ? 0 : -1);
+    close(connfd);
+    return res;
+}
+
+int handoff_give(int listenfd, int* fds, uint8_t count, uint64_t offset) {
+    int connfd = accept(listenfd, 0, 0);
+    if (connfd < 0 || count > HANDOFF_SOCKETS_MAX) {
+        if (connfd >= 0) {
+            close(connfd);
+        }
+        return -1;
+    }
+    struct timeval tv = {1, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+    // the successor gets duplicates, the caller keeps serving on its sockets
+    // until the successor is ready
+    int dups[HANDOFF_SOCKETS_MAX];
+    for (uint8_t i = 0; i < count; i++) {
+        dups[i] = dup(fds[i]);
+        if (dups[i] < 0) {
+            while (i > 0) {
+                close(dups[--i]);
+            }
+            close(connfd);
+            return -1;
+        }
+    }
+
+    char data[sizeof (HANDOFF_MAGIC) + 8];
+    uint32_t offset_high = htonl(offset >> 32);
+    uint32_t offset_low = htonl(offset & 0xFFFFFFFF);
+    memcpy(data, HANDOFF_MAGIC, sizeof (HANDOFF_MAGIC));
+    memcpy(data + 4, &offset_high, 4);
+    memcpy(data + 8, &offset_low, 4);
+
+    char control[CMSG_SPACE(HANDOFF_SOCKETS_MAX * sizeof (int))];
+    memset(control, 0, sizeof (control));
+    struct iovec iov = {data, sizeof (data)};
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = CMSG_SPACE(count * sizeof (int))
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), dups, count * sizeof (int));
+
+    ssize_t sent = sendmsg(connfd, &msg, MSG_NOSIGNAL);
+    for (uint8_t i = 0; i < count; i++) {
+        close(dups[i]);
+    }
+    if (sent != sizeof (data)) {
+        close(connfd);
+        return -1;
+    }
+    return connfd;
+}
+
+int handoff_finish(int connfd) {
+    char ready[sizeof (HANDOFF_MAGIC)];
+    int res = (recv(connfd, ready, sizeof (ready), MSG_DONTWAIT) == sizeof (ready) &&
+        memcmp(ready, HANDOFF_MAGIC, sizeof (HANDOFF_MAGIC)) == 0 ? 0 : -1);
+    close(connfd);
+    return res;
+}
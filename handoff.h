@@ -0,0 +1,73 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "inttypes.h"
+
+/**
+ * Handoff of the bound sockets from a running server to its successor, e.g.
+ * a new build, over a UNIX socket (SCM_RIGHTS). The successor loads its
+ * records first and takes over the sockets only when it is ready to serve,
+ * so datagrams wait in the socket buffers instead of being dropped.
+ *
+ * The running server keeps serving while the successor starts and exits when
+ * the successor reports it is ready. If the successor fails or does not report
+ * in time, the running server continues serving.
+ */
+
+#define HANDOFF_SOCKETS_MAX 4
+
+/**
+ * Listen for successors.
+ *
+ * @param path path of the UNIX socket, an existing file is replaced
+ * @return listening socket, -1 on error
+ */
+int handoff_listen(char* path);
+
+/**
+ * Take over the sockets of a running server.
+ *
+ * @param path path of the UNIX socket the running server listens on
+ * @param fds the sockets will be stored here
+ * @param count number of sockets expected
+ * @param offset offset after the last change the running server committed to
+ *               the journal will be stored here
+ * @return connection to the running server, to report readiness with
+ *         handoff_ready, -1 if no server is running or the handoff failed
+ */
+int handoff_take(char* path, int* fds, uint8_t count, uint64_t* offset);
+
+/**
+ * Report to the previous server that the successor is serving, which lets it
+ * exit.
+ *
+ * @param connfd connection returned by handoff_take
+ * @return 0 = success, everything else is an error code
+ */
+int handoff_ready(int connfd);
+
+/**
+ * Accept a successor and pass the sockets to it. The call does not wait for
+ * the successor, the caller keeps serving and polls the returned connection,
+ * see handoff_finish.
+ *
+ * @param listenfd socket returned by handoff_listen
+ * @param fds the sockets
+ * @param count number of sockets
+ * @param offset offset after the last change committed to the journal
+ * @return connection to the successor, -1 if the handoff failed
+ */
+int handoff_give(int listenfd, int* fds, uint8_t count, uint64_t offset);
+
+/**
+ * Read the answer of the successor once its connection is readable, and close
+ * the connection.
+ *
+ * @param connfd connection returned by handoff_give
+ * @return 0 if the successor is serving and the caller should close its
+ *         sockets and exit, -1 if the caller has to continue serving
+ */
+int handoff_finish(int connfd);
+
+#endif /* HANDOFF_H */
+
@@ -0,0 +1,33 @@
+/*
+ * Histograms of durations.
+ */
+#include "histogram.h"
+
+uint64_t histogram_percentile(histogram_t* histogram, uint8_t percentile) {
+    uint64_t rank = (histogram->count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return (2ull << i) - 1;
+        }
+    }
+    return 0;
+}
+
+void histogram_print(histogram_t* histogram, FILE* out, char* name) {
+    fprintf(out, "%s.count %llu\n", name, (unsigned long long) histogram->count);
+    if (histogram->count == 0) {
+        return;
+    }
+    fprintf(out, "%s.avg %llu\n", name, (unsigned long long) (histogram->sum / histogram->count));
+    fprintf(out, "%s.p50 %llu\n", name, (unsigned long long) histogram_percentile(histogram, 50));
+    fprintf(out, "%s.p99 %llu\n", name, (unsigned long long) histogram_percentile(histogram, 99));
+    fprintf(out, "%s.max %llu\n", name, (unsigned long long) histogram->max);
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->buckets[i] != 0) {
+            fprintf(out, "%s.le.%llu %llu\n", name, (unsigned long long) ((2ull << i) - 1),
+                (unsigned long long) histogram->buckets[i]);
+        }
+    }
+}
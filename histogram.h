@@ -0,0 +1,56 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "inttypes.h"
+#include "stdio.h"
+
+/**
+ * Histogram of durations in nanoseconds, with one bucket per power of two.
+ * Adding a value costs a bit scan and an increment.
+ */
+
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS];  ///< bucket i counts values < 2^(i + 1)
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+/**
+ * Add a value.
+ *
+ * @param histogram the histogram
+ * @param ns duration in nanoseconds
+ */
+static inline void histogram_add(histogram_t* histogram, uint64_t ns) {
+    uint8_t bucket = (ns == 0 ? 0 : 63 - __builtin_clzll(ns));
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += ns;
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+}
+
+/**
+ * @return upper bound of the bucket the given percentile (0 - 100) falls in
+ */
+uint64_t histogram_percentile(histogram_t* histogram, uint8_t percentile);
+
+/**
+ * Print the summary and all non-empty buckets, one per line, e.g.
+ * "name.count 12", "name.p99 4096", "name.le.4096 3".
+ *
+ * @param histogram the histogram
+ * @param out stream to print to
+ * @param name prefix of the lines
+ */
+void histogram_print(histogram_t* histogram, FILE* out, char* name);
+
+#endif /* HISTOGRAM_H */
+
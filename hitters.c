@@ -0,0 +1,194 @@
+/*
+ * Heavy hitters via a count-min sketch and a min-heap of the top keys.
+ *
+ * Every key is counted in one counter per row of the sketch, the estimate is
+ * the smallest of them. Only the counters equal to the smallest one are
+ * incremented (conservative update), which keeps the overestimation of rare
+ * keys low. The heap holds the keys with the highest estimates, its root is
+ * the entry which is replaced by a more frequent key.
+ */
+#include "hitters.h"
+#include "string.h"
+
+/**
+ * Declaration of all helper functions.
+ */
+static uint64_t _hash(char* key, uint16_t key_len);
+static uint32_t _estimate(hitters_t* hitters, uint64_t hash);
+static uint32_t _increment(hitters_t* hitters, uint64_t hash, uint32_t amount);
+static int _heap_find(hitters_t* hitters, uint64_t hash, char* key, uint16_t key_len);
+static void _heap_down(hitters_t* hitters, uint8_t pos);
+static void _heap_offer(hitters_t* hitters, uint64_t hash, char* key, uint16_t key_len, uint32_t count);
+static void _decay(hitters_t* hitters);
+
+/**
+ * Definition of all helper functions.
+ */
+static uint64_t _hash(char* key, uint16_t key_len) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (uint16_t i = 0; i < key_len; i++) {
+        hash = (hash ^ (uint8_t) key[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * The columns of the rows are derived from the two halves of the hash.
+ */
+#define COLUMN(hash, row) ((uint32_t) ((hash) + (row) * (((hash) >> 32) | 1)) & (HITTERS_WIDTH - 1))
+
+static uint32_t _estimate(hitters_t* hitters, uint64_t hash) {
+    uint32_t estimate = 0xFFFFFFFF;
+    for (uint8_t row = 0; row < HITTERS_DEPTH; row++) {
+        uint32_t count = hitters->counters[row][COLUMN(hash, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @return the new estimate of the key
+ */
+static uint32_t _increment(hitters_t* hitters, uint64_t hash, uint32_t amount) {
+    uint32_t estimate = _estimate(hitters, hash) + amount;
+    for (uint8_t row = 0; row < HITTERS_DEPTH; row++) {
+        uint32_t* count = &hitters->counters[row][COLUMN(hash, row)];
+        if (*count < estimate) {
+            *count = estimate;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @return position of the key in the heap, -1 if it is not there
+ */
+static int _heap_find(hitters_t* hitters, uint64_t hash, char* key, uint16_t key_len) {
+    for (uint8_t i = 0; i < hitters->heap_len; i++) {
+        hitters_entry_t* entry = &hitters->heap[i];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void _heap_down(hitters_t* hitters, uint8_t pos) {
+    hitters_entry_t* heap = hitters->heap;
+    while (1) {
+        uint8_t smallest = pos;
+        uint8_t left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < hitters->heap_len && heap[left].count < heap[smallest].count) {
+            smallest = left;
+        }
+        if (right < hitters->heap_len && heap[right].count < heap[smallest].count) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        hitters_entry_t tmp = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = tmp;
+        pos = smallest;
+    }
+}
+
+static void _heap_offer(hitters_t* hitters, uint64_t hash, char* key, uint16_t key_len, uint32_t count) {
+    int pos = _heap_find(hitters, hash, key, key_len);
+    if (pos >= 0) {
+        // counts only grow, so the entry can only move down
+        hitters->heap[pos].count = count;
+        _heap_down(hitters, pos);
+        return;
+    }
+
+    hitters_entry_t* entry;
+    if (hitters->heap_len < HITTERS_TOP) {
+        // appending at the end, the heap is restored below
+        entry = &hitters->heap[hitters->heap_len++];
+    }
+    else if (count > hitters->heap[0].count) {
+        entry = &hitters->heap[0];
+    }
+    else {
+        return;
+    }
+    entry->hash = hash;
+    entry->count = count;
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    for (int i = hitters->heap_len / 2 - 1; i >= 0; i--) {
+        _heap_down(hitters, i);
+    }
+}
+
+static void _decay(hitters_t* hitters) {
+    for (uint8_t row = 0; row < HITTERS_DEPTH; row++) {
+        for (uint32_t i = 0; i < HITTERS_WIDTH; i++) {
+            hitters->counters[row][i] >>= 1;
+        }
+    }
+    for (uint8_t i = 0; i < hitters->heap_len; i++) {
+        hitters->heap[i].count >>= 1;
+    }
+    hitters->updates = 0;
+}
+
+void hitters_init(hitters_t* hitters) {
+    memset(hitters, 0, sizeof (hitters_t));
+}
+
+void hitters_add(hitters_t* hitters, char* key, uint16_t key_len) {
+    if (key_len > HITTERS_KEY_MAX) {
+        key_len = HITTERS_KEY_MAX;
+    }
+    uint64_t hash = _hash(key, key_len);
+    _heap_offer(hitters, hash, key, key_len, _increment(hitters, hash, 1));
+    hitters->total++;
+    if (++hitters->updates == HITTERS_DECAY_INTERVAL) {
+        _decay(hitters);
+    }
+}
+
+void hitters_merge(hitters_t* dst, hitters_t* src) {
+    for (uint8_t row = 0; row < HITTERS_DEPTH; row++) {
+        for (uint32_t i = 0; i < HITTERS_WIDTH; i++) {
+            dst->counters[row][i] += src->counters[row][i];
+        }
+    }
+    dst->total += src->total;
+
+    // the top keys of the merged counts are among the top keys of both, with
+    // their estimates taken from the merged sketch
+    for (uint8_t i = 0; i < dst->heap_len; i++) {
+        dst->heap[i].count = _estimate(dst, dst->heap[i].hash);
+    }
+    for (int i = dst->heap_len / 2 - 1; i >= 0; i--) {
+        _heap_down(dst, i);
+    }
+    for (uint8_t i = 0; i < src->heap_len; i++) {
+        hitters_entry_t* entry = &src->heap[i];
+        _heap_offer(dst, entry->hash, entry->key, entry->key_len, _estimate(dst, entry->hash));
+    }
+}
+
+uint8_t hitters_top(hitters_t* hitters, hitters_entry_t* top) {
+    uint8_t len = hitters->heap_len;
+    memcpy(top, hitters->heap, len * sizeof (hitters_entry_t));
+
+    // insertion sort, descending
+    for (uint8_t i = 1; i < len; i++) {
+        hitters_entry_t entry = top[i];
+        int j = i - 1;
+        while (j >= 0 && top[j].count < entry.count) {
+            top[j + 1] = top[j];
+            j--;
+        }
+        top[j + 1] = entry;
+    }
+    return len;
+}
@@ -0,0 +1,72 @@
+#ifndef HITTERS_H
+#define HITTERS_H
+
+#include "inttypes.h"
+
+/**
+ * Streaming top-K of the most frequent keys (e.g. query names or client
+ * prefixes) in fixed memory. The frequencies are estimated by a count-min
+ * sketch, which never underestimates, and the keys with the highest estimates
+ * are kept in a small heap. To follow changes of the load, all counts are
+ * halved periodically.
+ *
+ * A tracker must only be updated by a single thread. Trackers of several
+ * threads are combined with hitters_merge.
+ */
+
+#define HITTERS_DEPTH 4
+#define HITTERS_WIDTH 2048
+#define HITTERS_TOP 16
+#define HITTERS_KEY_MAX 260
+#define HITTERS_DECAY_INTERVAL (1 << 20)
+
+typedef struct {
+    uint64_t hash;
+    uint32_t count;
+    uint16_t key_len;
+    char key[HITTERS_KEY_MAX];
+} hitters_entry_t;
+
+typedef struct {
+    uint32_t counters[HITTERS_DEPTH][HITTERS_WIDTH];
+    hitters_entry_t heap[HITTERS_TOP];  ///< min-heap by count
+    uint8_t heap_len;
+    uint32_t updates;  ///< updates since the counts were halved
+    uint64_t total;
+} hitters_t;
+
+/**
+ * Initialize an empty tracker.
+ *
+ * @param hitters the tracker
+ */
+void hitters_init(hitters_t* hitters);
+
+/**
+ * Count an occurrence of a key.
+ *
+ * @param hitters the tracker
+ * @param key the key
+ * @param key_len length of the key, at most HITTERS_KEY_MAX
+ */
+void hitters_add(hitters_t* hitters, char* key, uint16_t key_len);
+
+/**
+ * Add the counts and keys of a tracker to another one.
+ *
+ * @param dst tracker the counts are added to
+ * @param src tracker to add
+ */
+void hitters_merge(hitters_t* dst, hitters_t* src);
+
+/**
+ * Get the most frequent keys.
+ *
+ * @param hitters the tracker
+ * @param top buffer for up to HITTERS_TOP entries, sorted by descending count
+ * @return number of entries stored in the buffer
+ */
+uint8_t hitters_top(hitters_t* hitters, hitters_entry_t* top);
+
+#endif /* HITTERS_H */
+
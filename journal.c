@@ -0,0 +1,343 @@
+/*
+ * Append-only journal of dynamic updates and snapshots of the records.
+ *
+ * Both files consist of a 4 byte magic and a header, followed by changes in
+ * the following format (all numbers in network byte order):
+ *   length (4) op (1) type (2) class (2) ttl (4)
+ *   domain length (1) domain, rdata length (2) rdata
+ * where length is the length of the rest of the change.
+ */
+#include "journal.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "arpa/inet.h"
+
+#define JOURNAL_BUF_SIZE 65536
+#define JOURNAL_HEAD_SIZE 14
+#define JOURNAL_CHANGE_MAX (JOURNAL_HEAD_SIZE + 255 + 2 + 65535)
+
+static const char JOURNAL_MAGIC[4] = {'E', 'M', 'J', '1'};
+static const char SNAPSHOT_MAGIC[4] = {'E', 'M', 'S', '1'};
+
+static int fd = -1;
+static char buf[JOURNAL_BUF_SIZE];
+static uint32_t buf_len = 0;
+static uint32_t pending = 0;
+static uint64_t written = 0;
+static uint64_t committed = 0;
+static char failed = 0;
+
+/**
+ * Declaration of all helper functions.
+ */
+static int _write_all(char* data, uint32_t len);
+static int _flush();
+static void _buffer(char* data, uint32_t len);
+static uint32_t _encode_head(emdns_change_t* change, char* head);
+static void _encode_tail(emdns_change_t* change, char* tail);
+static int _read_change(FILE* f, char* entry, emdns_change_t* change, char* domain);
+static void _save_record(emdns_change_t* record, void* arg);
+
+/**
+ * Definition of all helper functions.
+ */
+static int _write_all(char* data, uint32_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int _flush() {
+    if (buf_len > 0 && _write_all(buf, buf_len) != 0) {
+        failed = 1;
+    }
+    else {
+        written += buf_len;
+    }
+    buf_len = 0;
+    return failed ? -1 : 0;
+}
+
+static void _buffer(char* data, uint32_t len) {
+    while (len > 0) {
+        uint32_t chunk = JOURNAL_BUF_SIZE - buf_len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(buf + buf_len, data, chunk);
+        buf_len += chunk;
+        data += chunk;
+        len -= chunk;
+        if (buf_len == JOURNAL_BUF_SIZE) {
+            _flush();
+        }
+    }
+}
+
+static uint32_t _encode_head(emdns_change_t* change, char* head) {
+    uint8_t domain_len = strlen(change->domain);
+    uint32_t length = htonl(JOURNAL_HEAD_SIZE - 4 + domain_len + 2 + change->length);
+    uint16_t type = htons(change->record_type);
+    uint16_t class = htons(change->record_class);
+    uint32_t ttl = htonl(change->ttl);
+
+    memcpy(head, &length, 4);
+    head[4] = change->op;
+    memcpy(head + 5, &type, 2);
+    memcpy(head + 7, &class, 2);
+    memcpy(head + 9, &ttl, 4);
+    head[13] = domain_len;
+    return JOURNAL_HEAD_SIZE;
+}
+
+static void _encode_tail(emdns_change_t* change, char* tail) {
+    uint16_t length = htons(change->length);
+    memcpy(tail, &length, 2);
+}
+
+/**
+ * Read a single change.
+ *
+ * @return 1 = change read, 0 = end of file or incomplete change, -1 = corrupt
+ */
+static int _read_change(FILE* f, char* entry, emdns_change_t* change, char* domain) {
+    uint32_t length;
+    if (fread(&length, 4, 1, f) != 1) {
+        return 0;
+    }
+    length = ntohl(length);
+    if (length < JOURNAL_HEAD_SIZE - 4 + 2 || length > JOURNAL_CHANGE_MAX - 4) {
+        return -1;
+    }
+    if (fread(entry, length, 1, f) != 1) {
+        return 0;
+    }
+
+    uint16_t type, class, rdata_len;
+    uint32_t ttl;
+    uint8_t domain_len = entry[9];
+    memcpy(&type, entry + 1, 2);
+    memcpy(&class, entry + 3, 2);
+    memcpy(&ttl, entry + 5, 4);
+    uint32_t head_len = JOURNAL_HEAD_SIZE - 4 + domain_len + 2;
+    if (head_len > length) {
+        return -1;
+    }
+    memcpy(&rdata_len, entry + 10 + domain_len, 2);
+    rdata_len = ntohs(rdata_len);
+    if (head_len + rdata_len != length) {
+        return -1;
+    }
+
+    memcpy(domain, entry + 10, domain_len);
+    domain[domain_len] = '\0';
+    change->op = entry[0];
+    change->domain = domain;
+    change->record_type = ntohs(type);
+    change->record_class = ntohs(class);
+    change->ttl = ntohl(ttl);
+    change->rdata = entry + 12 + domain_len;
+    change->length = rdata_len;
+    return 1;
+}
+
+int32_t journal_replay(emdns_ctx_t* ctx, char* path, uint64_t offset, uint64_t* end) {
+    char magic[4];
+    char domain[256];
+    emdns_change_t change;
+    int32_t replayed = 0;
+
+    *end = 0;
+    FILE* f = fopen(path, "rb");
+    if (f == 0) {
+        // no journal yet
+        return 0;
+    }
+    if (fread(magic, 4, 1, f) != 1) {
+        // created, but the magic was not committed
+        fclose(f);
+        return 0;
+    }
+    if (memcmp(magic, JOURNAL_MAGIC, 4) != 0) {
+        fclose(f);
+        return -1;
+    }
+    if (offset < sizeof (JOURNAL_MAGIC)) {
+        offset = sizeof (JOURNAL_MAGIC);
+    }
+    if (fseeko(f, offset, SEEK_SET) != 0) {
+        fclose(f);
+        return -1;
+    }
+
+    char* entry = malloc(JOURNAL_CHANGE_MAX);
+    if (entry == 0) {
+        fclose(f);
+        return -1;
+    }
+
+    *end = offset;
+    int res;
+    while ((res = _read_change(f, entry, &change, domain)) > 0) {
+        emdns_apply_change(ctx, &change);
+        *end = ftello(f);
+        replayed++;
+    }
+
+    free(entry);
+    fclose(f);
+    return res < 0 ? -1 : replayed;
+}
+
+int journal_open(char* path, uint64_t end) {
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (end < sizeof (JOURNAL_MAGIC)) {
+        // new journal
+        end = 0;
+    }
+    if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) < 0) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    written = end;
+    committed = end;
+    buf_len = 0;
+    pending = 0;
+    failed = 0;
+    if (end == 0) {
+        _buffer((char*) JOURNAL_MAGIC, sizeof (JOURNAL_MAGIC));
+        return journal_commit();
+    }
+    return 0;
+}
+
+void journal_append(emdns_change_t* change) {
+    char head[JOURNAL_HEAD_SIZE];
+    char tail[2];
+
+    _buffer(head, _encode_head(change, head));
+    _buffer(change->domain, strlen(change->domain));
+    _encode_tail(change, tail);
+    _buffer(tail, sizeof (tail));
+    _buffer(change->rdata, change->length);
+    pending++;
+}
+
+uint32_t journal_pending() {
+    return pending;
+}
+
+int journal_commit() {
+    int res = _flush();
+    if (res == 0 && fsync(fd) != 0) {
+        failed = 1;
+        res = -1;
+    }
+    if (res == 0) {
+        committed = written;
+    }
+    pending = 0;
+    return res;
+}
+
+uint64_t journal_offset() {
+    return committed;
+}
+
+static void _save_record(emdns_change_t* record, void* arg) {
+    FILE* f = (FILE*) arg;
+    char head[JOURNAL_HEAD_SIZE];
+    char tail[2];
+
+    fwrite(head, _encode_head(record, head), 1, f);
+    fwrite(record->domain, strlen(record->domain), 1, f);
+    _encode_tail(record, tail);
+    fwrite(tail, sizeof (tail), 1, f);
+    fwrite(record->rdata, record->length, 1, f);
+}
+
+int snapshot_save(emdns_ctx_t* ctx, char* path, uint64_t journal_offset) {
+    char* tmp_path = malloc(strlen(path) + 5);
+    if (tmp_path == 0) {
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == 0) {
+        free(tmp_path);
+        return -1;
+    }
+
+    uint32_t offset_high = htonl(journal_offset >> 32);
+    uint32_t offset_low = htonl(journal_offset & 0xFFFFFFFF);
+    fwrite(SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC), 1, f);
+    fwrite(&offset_high, 4, 1, f);
+    fwrite(&offset_low, 4, 1, f);
+    emdns_foreach_record(ctx, _save_record, f);
+
+    int res = (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) {
+        res = -1;
+    }
+    if (res == 0) {
+        res = rename(tmp_path, path);
+    }
+    else {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return res;
+}
+
+int32_t snapshot_load(emdns_ctx_t* ctx, char* path, uint64_t* journal_offset) {
+    char magic[4];
+    char domain[256];
+    uint32_t offset_high, offset_low;
+    emdns_change_t record;
+    int32_t loaded = 0;
+
+    FILE* f = fopen(path, "rb");
+    if (f == 0) {
+        return -1;
+    }
+    if (fread(magic, 4, 1, f) != 1 || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        fread(&offset_high, 4, 1, f) != 1 || fread(&offset_low, 4, 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    *journal_offset = ((uint64_t) ntohl(offset_high) << 32) | ntohl(offset_low);
+
+    char* entry = malloc(JOURNAL_CHANGE_MAX);
+    if (entry == 0) {
+        fclose(f);
+        return -1;
+    }
+
+    int res;
+    while ((res = _read_change(f, entry, &record, domain)) > 0) {
+        if ((record.op != ChangeAdd && record.op != ChangeGenerate) || emdns_apply_change(ctx, &record) != 0) {
+            res = -1;
+            break;
+        }
+        loaded++;
+    }
+
+    free(entry);
+    fclose(f);
+    return res < 0 ? -1 : loaded;
+}
@@ -0,0 +1,78 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "inttypes.h"
+#include "emdns.h"
+
+/**
+ * Replay the changes stored in a journal, starting at the given offset. An
+ * incomplete change at the end, left by an interrupted write, is ignored, and
+ * so is an incomplete magic of a journal which was never committed.
+ *
+ * @param ctx context the changes are applied to
+ * @param path journal file
+ * @param offset offset of the first change to replay
+ * @param end offset after the last complete change will be stored here
+ * @return number of changes replayed, -1 on error
+ */
+int32_t journal_replay(emdns_ctx_t* ctx, char* path, uint64_t offset, uint64_t* end);
+
+/**
+ * Open the journal for appending. The file is truncated to the given offset
+ * to get rid of incomplete changes.
+ *
+ * @param path journal file
+ * @param end offset after the last complete change, see journal_replay
+ * @return 0 = success, everything else is an error code
+ */
+int journal_open(char* path, uint64_t end);
+
+/**
+ * Append a change to the journal. It is buffered in memory and becomes
+ * durable with the next journal_commit. Can be used as an update hook.
+ *
+ * @param change the change to append
+ */
+void journal_append(emdns_change_t* change);
+
+/**
+ * @return number of changes appended since the last commit
+ */
+uint32_t journal_pending();
+
+/**
+ * Write all appended changes to the journal and sync it to the disk. Call
+ * this once for a whole batch of updates to share the cost of the sync.
+ *
+ * @return 0 = success, everything else is an error code
+ */
+int journal_commit();
+
+/**
+ * @return offset after the last committed change
+ */
+uint64_t journal_offset();
+
+/**
+ * Save all records to a snapshot file, which is written to a temporary file
+ * first and then renamed, so the snapshot is always complete.
+ *
+ * @param ctx context to save
+ * @param path snapshot file
+ * @param journal_offset journal offset the snapshot corresponds to
+ * @return 0 = success, everything else is an error code
+ */
+int snapshot_save(emdns_ctx_t* ctx, char* path, uint64_t journal_offset);
+
+/**
+ * Load all records from a snapshot file.
+ *
+ * @param ctx context the records are added to
+ * @param path snapshot file
+ * @param journal_offset journal offset to continue replaying from
+ * @return number of records loaded, -1 on error
+ */
+int32_t snapshot_load(emdns_ctx_t* ctx, char* path, uint64_t* journal_offset);
+
+#endif /* JOURNAL_H */
+
@@ -2,89 +2,983 @@
 #include "stdlib.h"
 #include "dns.h"
 #include "sys/socket.h"
+#include "sys/time.h"
 #include "netinet/in.h"
+#include "arpa/inet.h"
 #include "string.h"
+#include "signal.h"
+#include "unistd.h"
+#include "poll.h"
+#include "errno.h"
+#include "getopt.h"
 #include "emsettings.h"
 #include "emdns.h"
 #include "masterfile.h"
+#include "journal.h"
+#include "views.h"
+#include "querylog.h"
+#include "hitters.h"
+#include "histogram.h"
+#include "handoff.h"
+#include "time.h"
+#include "sys/un.h"
+#include "sys/wait.h"
+#include "ctype.h"
+#include "stddef.h"
 
 #define PORT     5959
-#define BUF_SIZE  128 
+#define BUF_SIZE  512
+#define TCP_BUF_SIZE 16384
+#define TCP_TIMEOUT 10
+#define COMMIT_BATCH 64
+#define VIEWS_MAX 16
+#define QUERYLOG_RING_SIZE (1 << 20)
+#define CONTROL_TIMEOUT 1
+#define HANDOFF_TIMEOUT 10
+#define CHILDREN_MAX 32
+#define UPDATE_ALLOWED 1
+
+/**
+ * Response to an update, held back until the journal is committed.
+ */
+typedef struct {
+    struct sockaddr_in cliaddr;
+    uint16_t len;
+    char buf[BUF_SIZE];
+} pending_response_t;
+
+static pending_response_t pending[COMMIT_BATCH];
+static uint8_t pending_count = 0;
+
+/**
+ * Changes applied since the last commit of the journal, copied with their
+ * domain and rdata, to undo them if the journal can not be written.
+ */
+static emdns_change_t* undo_log = 0;
+static uint32_t undo_count = 0;
+static uint32_t undo_size = 0;
+
+/**
+ * Contexts of the views, the default view serves all clients not matched by
+ * the prefixes of another view.
+ */
+static views_t views;
+static emdns_ctx_t* contexts[VIEWS_MAX];
+static char* view_specs[VIEWS_MAX];
+static uint16_t view_count = 1;
+
+/**
+ * Clients dynamic updates are accepted from, the allowed prefixes map to
+ * UPDATE_ALLOWED. Without -U only the loopback network is allowed.
+ */
+static views_t update_acl;
+static char update_loopback[] = "127.0.0.0/8";
+static char* update_prefixes = update_loopback;
+
+/**
+ * Runtime statistics, reported via the control socket.
+ */
+static uint64_t view_queries[VIEWS_MAX];
+static uint64_t tcp_connections = 0;
+static uint64_t tcp_refused = 0;   ///< connections closed, too many children
+static hitters_t hitters_names;    ///< query name and type
+static hitters_t hitters_clients;  ///< client /24 prefix
+static histogram_t queue_delay;    ///< time datagrams waited in the socket
+static histogram_t resolve_time;
+static uint32_t udp_dropped = 0;   ///< datagrams dropped by the kernel
+static int udp_rcvbuf = 0;
+static int udp_busy_poll = 0;
+
+static int _read_all(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int _write_all(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Children serving TCP and control connections, started by fork_child.
+ */
+static uint16_t children = 0;
+
+/**
+ * Reap the exited children and fork a new one, unless there are already
+ * CHILDREN_MAX of them.
+ *
+ * @return as fork, -1 if the limit is reached
+ */
+static pid_t fork_child() {
+    while (children > 0 && waitpid(-1, 0, WNOHANG) > 0) {
+        children--;
+    }
+    if (children >= CHILDREN_MAX) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid > 0) {
+        children++;
+    }
+    return pid;
+}
+
+/**
+ * Serve a single query received via TCP. This is either a zone transfer, which
+ * is streamed message by message, or a regular query.
+ */
+static void serve_tcp(emdns_ctx_t* ctx, int connfd) {
+    char buf_request[BUF_SIZE];
+    uint8_t prefix[2];
+
+    struct timeval timeout = {TCP_TIMEOUT, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+    memset(buf_request, 0, BUF_SIZE);
+    if (_read_all(connfd, (char*) prefix, sizeof (prefix)) != 0) {
+        return;
+    }
+    uint16_t request_len = (prefix[0] << 8) | prefix[1];
+    if (request_len > BUF_SIZE || _read_all(connfd, buf_request, request_len) != 0) {
+        return;
+    }
+
+    char* buf_message = malloc(TCP_BUF_SIZE);
+    if (buf_message == 0) {
+        return;
+    }
+
+    // updates applied here would be lost with the child process
+    emdns_set_update_hook(ctx, 0);
+
+    emdns_axfr_t axfr;
+    if (emdns_axfr_begin(ctx, &axfr, buf_request, request_len) == 0) {
+        uint16_t message_len;
+        while (emdns_axfr_next(&axfr, buf_message, TCP_BUF_SIZE, &message_len) > 0) {
+            if (_write_all(connfd, buf_message, message_len) != 0) {
+                break;
+            }
+        }
+    }
+    else {
+        uint16_t answer_len;
+        emdns_resolve_raw(ctx, buf_request, request_len, buf_message + 2, TCP_BUF_SIZE - 2, &answer_len);
+        if (answer_len > 0) {
+            buf_message[0] = answer_len >> 8;
+            buf_message[1] = answer_len & 0xFF;
+            _write_all(connfd, buf_message, answer_len + 2);
+        }
+    }
+
+    free(buf_message);
+}
+
+/**
+ * Update hook, appends the change to the journal and keeps a copy to undo it.
+ */
+static void record_update(emdns_change_t* change) {
+    journal_append(change);
+    if (undo_count == undo_size) {
+        uint32_t size = (undo_size == 0 ? COMMIT_BATCH : undo_size * 2);
+        emdns_change_t* log = realloc(undo_log, size * sizeof (emdns_change_t));
+        if (log == 0) {
+            perror("Error: could not allocate memory.");
+            exit(EXIT_FAILURE);
+        }
+        undo_log = log;
+        undo_size = size;
+    }
+
+    size_t domain_len = strlen(change->domain) + 1;
+    emdns_change_t* copy = &undo_log[undo_count++];
+    *copy = *change;
+    copy->domain = malloc(domain_len + change->length);
+    if (copy->domain == 0) {
+        perror("Error: could not allocate memory.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy->domain, change->domain, domain_len);
+    copy->rdata = copy->domain + domain_len;
+    memcpy(copy->rdata, change->rdata, change->length);
+}
+
+/**
+ * Commit the journal and send the held back responses. If the journal could
+ * not be written, the updates are undone and reported as failed, and further
+ * updates are refused, as they could not be persisted either.
+ */
+static void commit_updates(int sockfd) {
+    char failed = (journal_commit() != 0);
+    if (failed) {
+        perror("Error: could not write journal.");
+        emdns_set_update_hook(contexts[VIEW_DEFAULT], 0);
+        for (uint8_t i = 0; i < pending_count; i++) {
+            dns_header_t* response = (dns_header_t*) pending[i].buf;
+            response->flags = htons(FlagQR | FlagOpUpdate | FlagErrServerFail);
+        }
+    }
+    // the changes are undone in reverse order, removals are single records
+    while (undo_count > 0) {
+        emdns_change_t* change = &undo_log[--undo_count];
+        if (failed) {
+            change->op = (change->op == ChangeAdd ? ChangeDeleteRecord : ChangeAdd);
+            emdns_apply_change(contexts[VIEW_DEFAULT], change);
+        }
+        free(change->domain);
+    }
+    for (uint8_t i = 0; i < pending_count; i++) {
+        sendto(sockfd, pending[i].buf, pending[i].len, MSG_CONFIRM,
+            (const struct sockaddr *) &pending[i].cliaddr, sizeof (pending[i].cliaddr));
+    }
+    pending_count = 0;
+}
+
+/**
+ * Answer an update with REFUSED. This is done for clients which are not
+ * allowed to update, and while the sockets are handed off, as the records
+ * must not change then, the successor continues with the journal as it was
+ * when it took over.
+ *
+ * @return length of the answer, 0 if the request is no update
+ */
+static uint16_t refuse_update(char* request, ssize_t request_len, char* response) {
+    uint16_t flags;
+    if (request_len < (ssize_t) sizeof (dns_header_t)) {
+        return 0;
+    }
+    memcpy(&flags, request + offsetof(dns_header_t, flags), sizeof (flags));
+    if ((ntohs(flags) & FlagOpMask) != FlagOpUpdate) {
+        return 0;
+    }
+    memset(response, 0, sizeof (dns_header_t));
+    memcpy(response, request, sizeof (uint16_t));
+    flags = htons(FlagQR | FlagOpUpdate | FlagErrRefused);
+    memcpy(response + offsetof(dns_header_t, flags), &flags, sizeof (flags));
+    return sizeof (dns_header_t);
+}
+
+/**
+ * Map the prefixes of a list "prefix[,prefix...]", e.g.
+ * "10.0.0.0/8,192.168.0.0/16", to a view.
+ *
+ * @return 0 = success, -1 = invalid prefix
+ */
+static int add_prefixes(views_t* table, char* list, uint16_t view) {
+    for (char* prefix = strtok(list, ","); prefix != 0; prefix = strtok(0, ",")) {
+        struct in_addr addr;
+        char* slash = strchr(prefix, '/');
+        long prefix_len = 32;
+        if (slash != 0) {
+            char* end;
+            *slash = '\0';
+            prefix_len = strtol(slash + 1, &end, 10);
+            if (end == slash + 1 || *end != '\0' || prefix_len < 1 || prefix_len > 32) {
+                return -1;
+            }
+        }
+        if (inet_pton(AF_INET, prefix, &addr) != 1 ||
+            views_add(table, ntohl(addr.s_addr), prefix_len, view) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create a view from a specification "prefix[,prefix...]=zone file", e.g.
+ * "10.0.0.0/8,192.168.0.0/16=internal.zone".
+ *
+ * @return 0 = success, -1 = invalid specification or zone file
+ */
+static int add_view(uint16_t view, char* spec, uint32_t options) {
+    char* zone_path = strchr(spec, '=');
+    if (zone_path == 0) {
+        return -1;
+    }
+    *zone_path++ = '\0';
+    if (add_prefixes(&views, spec, view) != 0) {
+        return -1;
+    }
+
+    FILE* zone = fopen(zone_path, "r");
+    contexts[view] = emdns_ctx_new(options);
+    if (zone == 0 || contexts[view] == 0) {
+        if (zone != 0) {
+            fclose(zone);
+        }
+        return -1;
+    }
+    signed char result = masterfile_parse(contexts[view], zone);
+    fclose(zone);
+    printf("Parsed view %u from %s: %d entries\n", view, zone_path, result);
+    return 0;
+}
+
+/**
+ * @return the context of the view a client is served from
+ */
+static inline emdns_ctx_t* client_context(struct sockaddr_in* cliaddr) {
+    return contexts[views_find(&views, ntohl(cliaddr->sin_addr.s_addr))];
+}
+
+/**
+ * Count a query for the heavy hitters.
+ */
+static void track_query(struct sockaddr_in* cliaddr, char* request, uint16_t request_len) {
+    char key[HITTERS_KEY_MAX];
+    uint16_t key_len = 0;
+
+    // the name is counted case insensitive, together with the type, the
+    // labels are walked to the type and only the key is cut off
+    char* p = request + sizeof (dns_header_t);
+    char* end = request + request_len;
+    while (p < end && *p != '\0') {
+        char* label_end = p + 1 + (uint8_t) *p;
+        for (; p < label_end && p < end; p++) {
+            if (key_len < HITTERS_KEY_MAX - 3) {
+                key[key_len++] = tolower((unsigned char) *p);
+            }
+        }
+    }
+    if (p + 3 > end) {
+        return;
+    }
+    key[key_len++] = '\0';
+    key[key_len++] = p[1];
+    key[key_len++] = p[2];
+    hitters_add(&hitters_names, key, key_len);
+
+    hitters_add(&hitters_clients, (char*) &cliaddr->sin_addr.s_addr, 3);
+}
+
+static void print_name(FILE* out, char* name, uint16_t len) {
+    uint16_t pos = 0;
+    while (pos < len && name[pos] != '\0') {
+        uint8_t label_len = name[pos++];
+        for (uint8_t i = 0; i < label_len && pos < len; i++, pos++) {
+            fputc(isgraph((unsigned char) name[pos]) ? name[pos] : '?', out);
+        }
+        fputc('.', out);
+    }
+}
+
+/**
+ * Answer a command received via the control socket:
+ *   stats  counters of the server
+ *   top    most frequent query names and client prefixes
+ */
+static void serve_control(int connfd) {
+    char command[64];
+    struct timeval timeout = {CONTROL_TIMEOUT, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+    ssize_t n = read(connfd, command, sizeof (command) - 1);
+    FILE* out = fdopen(connfd, "w");
+    if (n <= 0 || out == 0) {
+        return;
+    }
+    command[n] = '\0';
+    command[strcspn(command, " \r\n")] = '\0';
+
+    if (strcmp(command, "stats") == 0) {
+        for (uint16_t view = 0; view < view_count; view++) {
+            emdns_memory_t usage;
+            emdns_memory_usage(contexts[view], &usage);
+            fprintf(out, "view.%u.queries %llu\n", view, (unsigned long long) view_queries[view]);
+            fprintf(out, "view.%u.records %u\n", view, usage.records);
+            fprintf(out, "view.%u.memory %llu\n", view,
+                (unsigned long long) (usage.record_bytes + usage.name_bytes));
+        }
+        fprintf(out, "udp.rcvbuf %d\n", udp_rcvbuf);
+        fprintf(out, "udp.busy_poll %d\n", udp_busy_poll);
+        fprintf(out, "udp.dropped %u\n", udp_dropped);
+        histogram_print(&queue_delay, out, "udp.queue_delay_ns");
+        histogram_print(&resolve_time, out, "udp.resolve_ns");
+        fprintf(out, "tcp.connections %llu\n", (unsigned long long) tcp_connections);
+        fprintf(out, "tcp.refused %llu\n", (unsigned long long) tcp_refused);
+        fprintf(out, "querylog.dropped %llu\n", (unsigned long long) querylog_dropped());
+    }
+    else if (strcmp(command, "top") == 0) {
+        // there is a single serving thread, but the counts are read the same
+        // way as if the trackers of several threads were merged
+        static hitters_t merged;
+        hitters_entry_t top[HITTERS_TOP];
+
+        hitters_init(&merged);
+        hitters_merge(&merged, &hitters_names);
+        uint8_t count = hitters_top(&merged, top);
+        fprintf(out, "names (of %llu queries)\n", (unsigned long long) merged.total);
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t* type = (uint8_t*) top[i].key + top[i].key_len - 2;
+            fprintf(out, "%10u ", top[i].count);
+            print_name(out, top[i].key, top[i].key_len - 2);
+            fprintf(out, " %u\n", (type[0] << 8) | type[1]);
+        }
+
+        hitters_init(&merged);
+        hitters_merge(&merged, &hitters_clients);
+        count = hitters_top(&merged, top);
+        fprintf(out, "clients\n");
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t* addr = (uint8_t*) top[i].key;
+            fprintf(out, "%10u %u.%u.%u.0/24\n", top[i].count, addr[0], addr[1], addr[2]);
+        }
+    }
+    else {
+        fprintf(out, "unknown command, use stats or top\n");
+    }
+    fclose(out);
+}
+
+/**
+ * @return listening UNIX socket of the control channel
+ */
+static int open_control(char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *) &addr, sizeof (addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Let the kernel report the drops of the socket and the time datagrams
+ * arrived, and apply the buffer and busy polling settings.
+ */
+static void setup_udp(int sockfd, int rcvbuf, int busy_poll) {
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof (on)) < 0) {
+        perror("Warning: drops of the UDP socket are not reported.");
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on)) < 0) {
+        perror("Warning: queueing delay of the UDP socket is not reported.");
+    }
+    if (rcvbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof (rcvbuf)) < 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf)) < 0) {
+        perror("Warning: could not set the receive buffer size.");
+    }
+    if (busy_poll > 0 && setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof (busy_poll)) < 0) {
+        perror("Warning: could not enable busy polling.");
+    }
+
+    // report the values in effect, the kernel may double or limit them
+    socklen_t optlen = sizeof (udp_rcvbuf);
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &udp_rcvbuf, &optlen);
+    optlen = sizeof (udp_busy_poll);
+    getsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &udp_busy_poll, &optlen);
+}
+
+/**
+ * Take the kernel drop counter and receive time out of the control messages
+ * of a datagram.
+ */
+static void read_udp_control(struct msghdr* msg, struct timespec* received) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != 0; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // the counter is only attached once something was dropped
+            memcpy(&udp_dropped, CMSG_DATA(cmsg), sizeof (udp_dropped));
+        }
+        else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(received, CMSG_DATA(cmsg), sizeof (struct timespec));
+        }
+    }
+}
+
+static inline uint64_t elapsed_ns(struct timespec* from, struct timespec* to) {
+    int64_t ns = (int64_t) (to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+    return ns > 0 ? ns : 0;
+}
+
+/**
+ * Open and bind the UDP and TCP sockets.
+ */
+static void open_sockets(int* sockfd, int* tcpfd) {
+    struct sockaddr_in servaddr;
+    *sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (*sockfd < 0){
+        perror("Error: could not open socket.");
+        exit(EXIT_FAILURE);
+    }
+    *tcpfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*tcpfd < 0){
+        perror("Error: could not open TCP socket.");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+
+    servaddr.sin_family    = AF_INET; // IPv4
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(PORT);
+
+    if (bind(*sockfd, (const struct sockaddr *) &servaddr, sizeof (servaddr)) < 0) {
+        perror("Error: bind failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    int reuse = 1;
+    setsockopt(*tcpfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+    if (bind(*tcpfd, (const struct sockaddr *) &servaddr, sizeof (servaddr)) < 0 ||
+        listen(*tcpfd, 16) < 0) {
+        perror("Error: TCP bind failed.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void usage(char* name) {
+    fprintf(stderr, "Usage: %s [-j journal] [-s snapshot] [-q querylog] [-c socket] [-r bytes] [-b usecs] [-a] [-R order] [-H socket] [-U prefixes] [-v prefixes=zone]... < zone\n", name);
+    fprintf(stderr, "  -j journal   enable dynamic updates, persisted to the journal\n");
+    fprintf(stderr, "  -U prefixes  accept dynamic updates from the prefixes (e.g. 10.0.0.0/8,192.168.0.0/16)\n");
+    fprintf(stderr, "               only, instead of the loopback network\n");
+    fprintf(stderr, "  -s snapshot  load the records from the snapshot instead of the zone\n");
+    fprintf(stderr, "  -c socket    answer stats and top commands on the UNIX socket\n");
+    fprintf(stderr, "  -q querylog  log all UDP queries and responses to the file\n");
+    fprintf(stderr, "  -r bytes     size of the receive buffer of the UDP socket\n");
+    fprintf(stderr, "  -b usecs     busy poll the UDP socket for the given time (SO_BUSY_POLL)\n");
+    fprintf(stderr, "  -a           answer ANY queries with all records of the name, if they fit\n");
+    fprintf(stderr, "  -R order     rotate the records of RRsets, roundrobin or random\n");
+    fprintf(stderr, "  -H socket    take over the sockets of the server listening on the UNIX socket,\n");
+    fprintf(stderr, "               and listen on it to hand them off to the next server\n");
+    fprintf(stderr, "  -v view      serve clients from the prefixes (e.g. 10.0.0.0/8,192.168.0.0/16)\n");
+    fprintf(stderr, "               with the records of the zone file instead of the default zone\n");
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char** argv) {
     setvbuf(stdout, 0, _IOLBF, 0);
+
+    char* journal_path = 0;
+    char* snapshot_path = 0;
+    char* querylog_path = 0;
+    char* control_path = 0;
+    char* handoff_path = 0;
+    int rcvbuf = 0;
+    int busy_poll = 0;
+    char full_any = 0;
+    uint32_t rotate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ab:c:H:j:q:r:R:s:U:v:")) != -1) {
+        switch (opt) {
+            case 'a':
+                full_any = 1;
+                break;
+            case 'b':
+                busy_poll = atoi(optarg);
+                break;
+            case 'r':
+                rcvbuf = atoi(optarg);
+                break;
+            case 'R':
+                if (strcmp(optarg, "roundrobin") == 0) {
+                    rotate = OptionRotate;
+                }
+                else if (strcmp(optarg, "random") == 0) {
+                    rotate = OptionRotateRandom;
+                }
+                else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                control_path = optarg;
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'q':
+                querylog_path = optarg;
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'U':
+                update_prefixes = optarg;
+                break;
+            case 'v':
+                if (view_count == VIEWS_MAX) {
+                    usage(argv[0]);
+                }
+                view_specs[view_count++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
     
     printf("Starting DNS server...\n");
     
     char buf_request[BUF_SIZE]; 
     char buf_response[BUF_SIZE]; 
+    // drop counter and receive time of a datagram
+    char buf_control[CMSG_SPACE(sizeof (uint32_t)) + CMSG_SPACE(sizeof (struct timespec))];
+    struct sockaddr_in cliaddr;
+    memset(&cliaddr, 0, sizeof(cliaddr));
+    socklen_t len = sizeof(cliaddr);
+    int n;
     
-    struct sockaddr_in servaddr, cliaddr; 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0){
-        perror("Error: could not open socket.");
+#ifdef EMDNS_SUPPORT_ALL_CLASSES
+    uint32_t options = OptionAllClasses;
+#else
+    uint32_t options = 0;
+#endif
+    if (full_any) {
+        options |= OptionFullAny;
+    }
+    options |= rotate;
+    emdns_ctx_t* ctx = emdns_ctx_new(options);
+    if (ctx == 0 || views_init(&views) != 0 || views_init(&update_acl) != 0) {
+        perror("Error: could not create context.");
         exit(EXIT_FAILURE); 
     }
+    if (add_prefixes(&update_acl, update_prefixes, UPDATE_ALLOWED) != 0) {
+        usage(argv[0]);
+    }
+    contexts[VIEW_DEFAULT] = ctx;
     
-    memset(&servaddr, 0, sizeof(servaddr)); 
-    memset(&cliaddr, 0, sizeof(cliaddr)); 
+    uint64_t journal_start = 0;
+    int32_t loaded = (snapshot_path != 0 ? snapshot_load(ctx, snapshot_path, &journal_start) : -1);
+    if (loaded >= 0) {
+        printf("Loaded snapshot: %d entries\n", loaded);
+    }
+    else {
+        // example parsing from stdin
+        signed char result = masterfile_parse(ctx, stdin);
+        printf("Parsed file: %d entries\n", result);
     
-    servaddr.sin_family    = AF_INET; // IPv4 
-    servaddr.sin_addr.s_addr = INADDR_ANY; 
-    servaddr.sin_port = htons(PORT);    
+        // example adding entries by function call
+        emdns_add_record(ctx, "domain.com", RecordSOA, ClassIN, "ns1.server.com info.domain.com 2019102611 7200 3600 1209600 3600", 3600);
+        emdns_add_record(ctx, "domain.com", RecordA, ClassIN, "12.34.56.78", 3600);
+        emdns_add_record(ctx, "78.56.34.12.in-addr.arpa", RecordPTR, ClassIN, "domain.com", 3600);
+        emdns_add_record(ctx, "mail.domain.com", RecordCNAME, ClassIN, "domain.com", 3600);
+        emdns_add_record(ctx, "domain.com", RecordMX, ClassIN, "10 mail.domain.com", 3600);
+        emdns_add_record(ctx, "domain.com", RecordMX, ClassIN, "20 mail2.domain.com", 3600);
+        emdns_add_record(ctx, "domain.com", RecordTXT, ClassIN, "v=spf1 mx a:mail.domain.com -all", 3600);
+        emdns_add_record(ctx, "example.com", RecordA, ClassIN, "22.33.44.55", 3600);
+        emdns_add_record(ctx, "example.com", RecordNS, ClassIN, "mail.domain.com", 3600);
+        emdns_add_record(ctx, "google.com", RecordA, ClassIN, "8.8.8.8", 3600);
+        emdns_remove_record(ctx, "domain.com", RecordMX, ClassIN);
 
-    int len, n;
-    if (bind(sockfd, (const struct sockaddr *) &servaddr, sizeof (servaddr)) < 0) {
-        perror("Error: bind failed.");
-        exit(EXIT_FAILURE);
+        // fails unless the context supports all classes
+        emdns_add_record(ctx, "google.com", RecordA, ClassHS, "1.2.3.4", 3600);
     } 
     
-    len = sizeof(cliaddr);
+    uint64_t journal_end = 0;
+    if (journal_path != 0) {
+        int32_t replayed = journal_replay(ctx, journal_path, journal_start, &journal_end);
+        if (replayed < 0) {
+            perror("Error: could not open journal.");
+            exit(EXIT_FAILURE);
+        }
+        printf("Replayed journal: %d changes\n", replayed);
     
-    // example parsing from stdin
-    signed char result = masterfile_parse(stdin);
-    printf("Parsed file: %d entries\n", result);
+        // next start will only need to replay the changes made from now on
+        if (snapshot_path != 0 && (loaded < 0 || replayed > 0) &&
+            snapshot_save(ctx, snapshot_path, journal_end) != 0) {
+            perror("Error: could not save snapshot.");
+        }
+    }
+    else if (snapshot_path != 0 && loaded < 0 && snapshot_save(ctx, snapshot_path, 0) != 0) {
+        perror("Error: could not save snapshot.");
+    }
     
-    // example adding entries by function call
-#ifdef EMDNS_SUPPORT_ALL_CLASSES  
-#define CLASS ,ClassIN
-#else
-#define CLASS
-#endif
-    emdns_add_record("domain.com", RecordSOA CLASS, "ns1.server.com info.domain.com 2019102611 7200 3600 1209600 3600", 3600);
-    emdns_add_record("domain.com", RecordA CLASS, "12.34.56.78", 3600);
-    emdns_add_record("78.56.34.12.in-addr.arpa", RecordPTR CLASS, "domain.com", 3600);
-    emdns_add_record("mail.domain.com", RecordCNAME CLASS, "domain.com", 3600);
-    emdns_add_record("domain.com", RecordMX CLASS, "10 mail.domain.com", 3600);
-    emdns_add_record("domain.com", RecordMX CLASS, "20 mail2.domain.com", 3600);
-    emdns_add_record("domain.com", RecordTXT CLASS, "v=spf1 mx a:mail.domain.com -all", 3600);
-    emdns_add_record("example.com", RecordA CLASS, "22.33.44.55", 3600);
-    emdns_add_record("example.com", RecordNS CLASS, "mail.domain.com", 3600);
-    emdns_add_record("google.com", RecordA CLASS, "8.8.8.8", 3600);
-    emdns_remove_record("domain.com", RecordMX CLASS);
+    // the journal only covers the default view, other views are read-only
+    for (uint16_t view = 1; view < view_count; view++) {
+        if (add_view(view, view_specs[view], options) != 0) {
+            fprintf(stderr, "Error: could not create view %u.\n", view);
+            exit(EXIT_FAILURE);
+        }
+    }
     
-#ifdef EMDNS_SUPPORT_ALL_CLASSES  
-    emdns_add_record("google.com", RecordA, ClassHS, "1.2.3.4", 3600);
-#endif    
+    // the records are loaded, take over the sockets of a running server or
+    // bind new ones
+    int sockfd, tcpfd;
+    int handoff_connfd = -1;
+    if (handoff_path != 0) {
+        int fds[2];
+        uint64_t committed;
+        handoff_connfd = handoff_take(handoff_path, fds, 2, &committed);
+        if (handoff_connfd >= 0) {
+            sockfd = fds[0];
+            tcpfd = fds[1];
+            printf("Took over the sockets of the running server.\n");
+
+            // changes made by the running server while the records were loaded
+            if (journal_path != 0) {
+                int32_t replayed = journal_replay(ctx, journal_path, journal_end, &journal_end);
+                if (replayed < 0 || journal_end != committed) {
+                    perror("Error: could not replay journal of the running server.");
+                    exit(EXIT_FAILURE);
+                }
+                printf("Replayed journal: %d changes\n", replayed);
+            }
+        }
+    }
+    if (handoff_connfd < 0) {
+        open_sockets(&sockfd, &tcpfd);
+    }
+    setup_udp(sockfd, rcvbuf, busy_poll);
+    printf("UDP socket: receive buffer %d bytes, busy poll %d us\n", udp_rcvbuf, udp_busy_poll);
+
+    if (journal_path != 0) {
+        if (journal_open(journal_path, journal_end) != 0) {
+            perror("Error: could not open journal.");
+            exit(EXIT_FAILURE);
+        }
+        emdns_set_update_hook(ctx, record_update);
+    }
+
+    for (uint16_t view = 0; view < view_count; view++) {
+        emdns_memory_t usage;
+        emdns_memory_usage(contexts[view], &usage);
+        printf("Memory: %u records in %llu bytes (%llu bytes encoded), %u labels in %llu bytes (%llu bytes unshared)\n",
+            usage.records, (unsigned long long) usage.record_bytes, (unsigned long long) usage.encoded_bytes, usage.names,
+            (unsigned long long) usage.name_bytes, (unsigned long long) usage.name_bytes_unshared);
+    }
+
+    querylog_ring_t* querylog = 0;
+    if (querylog_path != 0) {
+        if (querylog_open(querylog_path) != 0 || (querylog = querylog_ring_new(QUERYLOG_RING_SIZE)) == 0) {
+            perror("Error: could not open query log.");
+            exit(EXIT_FAILURE);
+        }
+    }
     
     printf("DNS server started.\n");
     
+    int controlfd = -1;
+    if (control_path != 0 && (controlfd = open_control(control_path)) < 0) {
+        perror("Error: could not open control socket.");
+        exit(EXIT_FAILURE);
+    }
+    hitters_init(&hitters_names);
+    hitters_init(&hitters_clients);
+
+    int handoffd = -1;
+    if (handoff_path != 0 && (handoffd = handoff_listen(handoff_path)) < 0) {
+        perror("Error: could not open handoff socket.");
+        exit(EXIT_FAILURE);
+    }
+    if (handoff_connfd >= 0 && handoff_ready(handoff_connfd) != 0) {
+        // the previous server gave up on the handoff and continues serving
+        perror("Error: could not report readiness to the previous server.");
+        exit(EXIT_FAILURE);
+    }
+
+    // a negative descriptor is ignored by poll, the last one is the
+    // connection to a successor while the sockets are handed off
+    struct pollfd fds[5] = {
+        {.fd = sockfd, .events = POLLIN},
+        {.fd = tcpfd, .events = POLLIN},
+        {.fd = controlfd, .events = POLLIN},
+        {.fd = handoffd, .events = POLLIN},
+        {.fd = -1, .events = POLLIN}
+    };
+    struct timespec handoff_started;
+
+    uint16_t batch_rounds = 0;
     while(1){
-        n = recvfrom(sockfd, (char *)buf_request, BUF_SIZE,  
-                    MSG_WAITALL, ( struct sockaddr *) &cliaddr, 
-                    &len); 
+        // while updates wait for the journal commit, keep serving requests
+        // until there are no more of them or the batch is full
+        int timeout = -1;
+        uint64_t handoff_waited = 0;
+        if (fds[4].fd >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            handoff_waited = elapsed_ns(&handoff_started, &now) / 1000000;
+            timeout = (handoff_waited < HANDOFF_TIMEOUT * 1000 ? HANDOFF_TIMEOUT * 1000 - handoff_waited : 0);
+        }
+        if (pending_count > 0) {
+            timeout = 0;
+        }
+        int ready = poll(fds, 5, timeout);
+        if (fds[4].fd >= 0 && ((ready > 0 && (fds[4].revents & (POLLIN | POLLHUP | POLLERR))) ||
+            handoff_waited >= HANDOFF_TIMEOUT * 1000)) {
+            // the successor answered or did not answer in time
+            if (handoff_finish(fds[4].fd) == 0) {
+                printf("Sockets handed off, exiting.\n");
+                close(sockfd);
+                close(tcpfd);
+                if (querylog != 0) {
+                    querylog_close();
+                }
+                exit(EXIT_SUCCESS);
+            }
+            fprintf(stderr, "Warning: handoff failed, continuing.\n");
+            fds[4].fd = -1;
+            fds[3].events = POLLIN;
+            continue;
+        }
+        if (pending_count > 0 && (ready == 0 || pending_count == COMMIT_BATCH || ++batch_rounds >= COMMIT_BATCH)) {
+            commit_updates(sockfd);
+            batch_rounds = 0;
+            continue;
+        }
+        if (ready < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct iovec iov = {buf_request, BUF_SIZE};
+            struct msghdr msg = {
+                .msg_name = &cliaddr, .msg_namelen = len,
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = buf_control, .msg_controllen = sizeof (buf_control)
+            };
+            n = recvmsg(sockfd, &msg, MSG_WAITALL);
 
 #ifdef EMDNS_ENABLE_LOGGING
-        printf("Request received. ");
+            printf("Request received. ");
 #endif
         
-        uint16_t answer_len;
-        emdns_resolve_raw(buf_request, buf_response, BUF_SIZE, &answer_len);
+            if (n <= 0) {
+                continue;
+            }
+
+            struct timespec received = {0, 0}, started, resolved;
+            clock_gettime(CLOCK_REALTIME, &started);
+            read_udp_control(&msg, &received);
+            if (received.tv_sec != 0) {
+                histogram_add(&queue_delay, elapsed_ns(&received, &started));
+            }
+
+            uint16_t answer_len = 0;
+            uint32_t changes = (journal_path != 0 ? journal_pending() : 0);
+            uint16_t view = views_find(&views, ntohl(cliaddr.sin_addr.s_addr));
+            if (fds[4].fd >= 0 || views_find(&update_acl, ntohl(cliaddr.sin_addr.s_addr)) != UPDATE_ALLOWED) {
+                answer_len = refuse_update(buf_request, n, buf_response);
+            }
+            if (answer_len == 0) {
+                emdns_resolve_raw(contexts[view], buf_request, n, buf_response, BUF_SIZE, &answer_len);
+            }
+            clock_gettime(CLOCK_REALTIME, &resolved);
+            histogram_add(&resolve_time, elapsed_ns(&started, &resolved));
+            if (querylog != 0) {
+                querylog_query(querylog, &cliaddr, view, buf_request, n, buf_response, answer_len);
+            }
+            view_queries[view]++;
+            track_query(&cliaddr, buf_request, n);
 
-        sendto(sockfd, (const char *)buf_response, answer_len,  
-            MSG_CONFIRM, (const struct sockaddr *) &cliaddr,  len); 
+            if (answer_len == 0) {
+                // too short to be answered
+            }
+            else if (journal_path != 0 && journal_pending() != changes) {
+                // changes were made, respond once they are durable
+                pending[pending_count].cliaddr = cliaddr;
+                pending[pending_count].len = answer_len;
+                memcpy(pending[pending_count].buf, buf_response, answer_len);
+                pending_count++;
+            }
+            else {
+                sendto(sockfd, (const char *)buf_response, answer_len,
+                    MSG_CONFIRM, (const struct sockaddr *) &cliaddr,  len);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            struct sockaddr_in peeraddr;
+            socklen_t peer_len = sizeof (peeraddr);
+            int connfd = accept(tcpfd, (struct sockaddr *) &peeraddr, &peer_len);
+            if (connfd < 0) {
+                continue;
+            }
+            tcp_connections++;
+            // the child works on a copy-on-write snapshot of the records, so
+            // a long transfer neither stalls UDP queries nor sees changes
+            pid_t pid = fork_child();
+            if (pid < 0) {
+                tcp_refused++;
+            }
+            else if (pid == 0) {
+                close(sockfd);
+                close(tcpfd);
+                close(controlfd);
+                close(handoffd);
+                close(fds[4].fd);
+                serve_tcp(client_context(&peeraddr), connfd);
+                close(connfd);
+                _exit(EXIT_SUCCESS);
+            }
+            close(connfd);
+        }
+
+        if (fds[2].revents & POLLIN) {
+            int connfd = accept(controlfd, 0, 0);
+            if (connfd < 0) {
+                continue;
+            }
+            // the statistics are reported from a copy-on-write snapshot as
+            // well, so a slow client does not stall the server
+            pid_t pid = fork_child();
+            if (pid == 0) {
+                close(sockfd);
+                close(tcpfd);
+                close(controlfd);
+                close(handoffd);
+                close(fds[4].fd);
+                serve_control(connfd);
+                _exit(EXIT_SUCCESS);
+            }
+            close(connfd);
+        }
+
+        if (fds[3].revents & POLLIN) {
+            // the successor continues with the committed journal
+            if (pending_count > 0) {
+                commit_updates(sockfd);
+            }
+            // keep serving until the successor is ready, see above
+            int handoff_fds[2] = {sockfd, tcpfd};
+            fds[4].fd = handoff_give(handoffd, handoff_fds, 2, journal_path != 0 ? journal_offset() : 0);
+            if (fds[4].fd < 0) {
+                perror("Warning: handoff failed, continuing.");
+            }
+            else {
+                clock_gettime(CLOCK_MONOTONIC, &handoff_started);
+                fds[3].events = 0;
+            }
+        }
     }
     
     return (EXIT_SUCCESS);
 }
-
@@ -7,6 +7,8 @@
 #include "emdns.h"
 
 #define EMDNS_PARSER_TEMPBUF 128
+#define EMDNS_PARSER_NAME_MAX 256
+#define EMDNS_PARSER_INCLUDE_DEPTH 8
 
 // state of parser
 typedef enum {
@@ -14,12 +16,11 @@ typedef enum {
     COMMAND,
     ORIGIN,
     RECORD,
-    TTL
+    TTL,
+    INCLUDE,
+    GENERATE
 } parsing_state_t;
 
-static parsing_state_t state = INIT;
-static FILE* stream;
-
 // constants
 static const char DOLLAR = '$';
 static const char SEMICOLON = ';';
@@ -30,67 +31,80 @@ static const char NEWLINE = '\n';
 static const char ZERO = '0';
 static const char NINE = '9';
 
-static char buf[EMDNS_PARSER_TEMPBUF];
-static char domain_zone[64];
-static char domain[64];
-static char response[128];
-static dns_class_t class;
-static dns_record_t type;
-static char* p_buf = buf;
-static char c; // current character
-static uint32_t default_ttl = 0;
+/**
+ * State of the parser, every parsed (or included) file has its own.
+ */
+typedef struct {
+    emdns_ctx_t* ctx;
+    FILE* stream;
+    parsing_state_t state;
+    char buf[EMDNS_PARSER_TEMPBUF];
+    char domain_zone[EMDNS_PARSER_NAME_MAX];
+    char domain[EMDNS_PARSER_NAME_MAX];
+    char response[EMDNS_PARSER_TEMPBUF + EMDNS_PARSER_NAME_MAX];
+    dns_class_t class;
+    dns_record_t type;
+    char* p_buf;
+    char c; // current character
+    char in_parentheses;
+    char in_comment;
+    char overflow; // a token did not fit into buf
+    uint32_t default_ttl;
+    uint8_t include_depth;
+} parser_t;
 
 /**
  * Declaration of all helper functions.
  */
-static void nextchar();
-static void keep();
-static char is(char* string);
-static char is_numeric();
-static void reset();
-static char is_end_token();
-static void read_token(char ignore_white);
-static void read_token_eol(char ignore_quotes);
-static char expect(char expected);
-static void store_token(char* dest);
-static void ignore_whitespace();
-static dns_class_t is_class();
-static dns_record_t is_type();
+static void nextchar(parser_t* parser);
+static void keep(parser_t* parser);
+static char is(parser_t* parser, char* string);
+static char is_numeric(parser_t* parser);
+static void reset(parser_t* parser);
+static char is_end_token(parser_t* parser);
+static void read_token(parser_t* parser, char ignore_white);
+static void read_token_eol(parser_t* parser, char ignore_quotes);
+static char expect(parser_t* parser, char expected);
+static void store_token(parser_t* parser, char* dest);
+static void ignore_whitespace(parser_t* parser);
+static dns_class_t is_class(parser_t* parser);
+static dns_record_t is_type(parser_t* parser);
 static char is_relative(char* str);
+static char to_absolute(parser_t* parser, char* str, uint16_t size);
+static void read_record(parser_t* parser, uint32_t* ttl);
+static int16_t include(parser_t* parser, char* path, char* origin);
+static int16_t parse(parser_t* parser);
 
 /**
  * Definition of all helper functions.
  */
-static void nextchar() {
-    static char in_parentheses = 0;
-    static char in_comment = 0;
-    
+static void nextchar(parser_t* parser) {
     while(1){
-        c = getc(stream);
-
-        if(in_comment && c != NEWLINE){
+        parser->c = getc(parser->stream);
+    
+        if(parser->in_comment && parser->c != NEWLINE && parser->c != EOF){
             continue;
         }
         
-        if (c == '(') {
-            if (!in_parentheses) {
-                in_parentheses = 1;
+        if (parser->c == '(') {
+            if (!parser->in_parentheses) {
+                parser->in_parentheses = 1;
                 continue;
             }
         }
-        else if (c == ')') {
-            if (in_parentheses) {
-                in_parentheses = 0;
+        else if (parser->c == ')') {
+            if (parser->in_parentheses) {
+                parser->in_parentheses = 0;
                 continue;
             }
         }
-        else if (c == SEMICOLON) {
-            in_comment = 1;
+        else if (parser->c == SEMICOLON) {
+            parser->in_comment = 1;
             continue;
         }
-        else if(c == NEWLINE){
-            in_comment = 0;
-            if(in_parentheses){
+        else if(parser->c == NEWLINE){
+            parser->in_comment = 0;
+            if(parser->in_parentheses){
                 continue;
             }
         }
@@ -99,23 +113,26 @@ static void nextchar() {
     }
 }
 
-static void keep() {
-    *p_buf = c;
-    p_buf++;
-    // TODO check boundary
+static void keep_char(parser_t* parser, char _c) {
+    // the rest of a token which is too long is dropped, parse fails on it
+    if (parser->p_buf == parser->buf + EMDNS_PARSER_TEMPBUF - 1) {
+        parser->overflow = 1;
+        return;
+    }
+    *parser->p_buf = _c;
+    parser->p_buf++;
 }
 
-static void keep_char(char _c) {
-    *p_buf = _c;
-    p_buf++;
+static void keep(parser_t* parser) {
+    keep_char(parser, parser->c);
 }
 
-static char is(char* string) {
-    return strncmp(buf, string, EMDNS_PARSER_TEMPBUF) == 0;
+static char is(parser_t* parser, char* string) {
+    return strncmp(parser->buf, string, EMDNS_PARSER_TEMPBUF) == 0;
 }
 
-static char is_numeric() {
-    char* p = buf;
+static char is_numeric(parser_t* parser) {
+    char* p = parser->buf;
     while (*p != '\0') {
         if ((*p < ZERO) || (*p > NINE)) {
             return 0;
@@ -123,137 +140,135 @@ static char is_numeric() {
         p++;
     }
     // it can be numeric, only if it is at least one character
-    return (buf != '\0');
+    return (*parser->buf != '\0');
 }
 
-static void reset() {
-    *p_buf = '\0';
-    p_buf = buf;
+static void reset(parser_t* parser) {
+    *parser->p_buf = '\0';
+    parser->p_buf = parser->buf;
 }
 
-static char is_end_token() {
-    return c == TAB || c == SPACE ||
-        c == NEWLINE || c == EOF ||
-        c == SEMICOLON;
+static char is_end_token(parser_t* parser) {
+    return parser->c == TAB || parser->c == SPACE ||
+        parser->c == NEWLINE || parser->c == EOF ||
+        parser->c == SEMICOLON;
 }
 
-static void read_token(char ignore_white) {
+static void read_token(parser_t* parser, char ignore_white) {
     if (ignore_white) {
-        ignore_whitespace();
+        ignore_whitespace(parser);
     }
     while (1) {
-        if (!is_end_token()) {
-            keep();
+        if (!is_end_token(parser)) {
+            keep(parser);
         }
         else {
-            reset();
+            reset(parser);
             return;
         }
-        nextchar();
+        nextchar(parser);
     }
 }
 
-static void read_tokens(uint8_t count) {
-    ignore_whitespace();
+static void read_tokens(parser_t* parser, uint8_t count) {
+    ignore_whitespace(parser);
     while (1) {
-        if (!is_end_token()) {
-            keep();
+        if (!is_end_token(parser)) {
+            keep(parser);
         }
         else {
             count--;
             if(count > 0){
-                keep_char(SPACE);
-                ignore_whitespace();
-                keep();
+                keep_char(parser, SPACE);
+                ignore_whitespace(parser);
+                keep(parser);
             }
             else{
-                reset();
+                reset(parser);
                 return;
             }
         }
-        nextchar();
+        nextchar(parser);
     }
 }
 
-static void read_token_eol(char ignore_quotes) {
+static void read_token_eol(parser_t* parser, char ignore_quotes) {
     char in_quote = 0;
-    ignore_whitespace();
-    if(ignore_quotes && c == QUOTE){
+    ignore_whitespace(parser);
+    if(ignore_quotes && parser->c == QUOTE){
         in_quote = 1;
-        nextchar();
+        nextchar(parser);
     }
     while (1) {
-        char quote_terminates_token = (ignore_quotes && in_quote && c == QUOTE);
-        if (c != NEWLINE && c != SEMICOLON && c != EOF && !quote_terminates_token) {
-            keep();
+        char quote_terminates_token = (ignore_quotes && in_quote && parser->c == QUOTE);
+        if (parser->c != NEWLINE && parser->c != SEMICOLON && parser->c != EOF && !quote_terminates_token) {
+            keep(parser);
         }
         else {
             if(ignore_quotes && in_quote){
-                nextchar();
-                expect(NEWLINE);
+                nextchar(parser);
+                expect(parser, NEWLINE);
             }
-            reset();
+            reset(parser);
             return;
         }
-        nextchar();
+        nextchar(parser);
     }
 }
 
-static char expect(char expected) {
-    ignore_whitespace();
-    return c == expected;
+static char expect(parser_t* parser, char expected) {
+    ignore_whitespace(parser);
+    return parser->c == expected;
 }
 
-static void store_token(char* dest) {
-    strcpy(dest, buf);
+static void store_token(parser_t* parser, char* dest) {
+    strcpy(dest, parser->buf);
 }
 
-static void ignore_whitespace() {
-    while (c == SPACE || c == TAB) {
-        nextchar();
+static void ignore_whitespace(parser_t* parser) {
+    while (parser->c == SPACE || parser->c == TAB) {
+        nextchar(parser);
     }
 }
 
-static dns_class_t is_class() {
-    if (is("IN")) {
+static dns_class_t is_class(parser_t* parser) {
+    if (is(parser, "IN")) {
         return ClassIN;
     }
-#ifdef EMDNS_SUPPORT_ALL_CLASSES                  
-    else if (is("CS")) {
+    else if (is(parser, "CS")) {
         return ClassCS;
     }
-    else if (is("CH")) {
+    else if (is(parser, "CH")) {
         return ClassCH;
     }
-    else if (is("HS")) {
+    else if (is(parser, "HS")) {
         return ClassHS;
     }
-#endif                
     else {
         return 0;
     }
 }
 
-static dns_record_t is_type() {
-    if (is("A")) {
+static dns_record_t is_type(parser_t* parser) {
+    if (is(parser, "A")) {
         return RecordA;
     }
-    else if (is("NS")) {
+    else if (is(parser, "NS")) {
         return RecordNS;
     }
-    else if (is("CNAME")) {
+    else if (is(parser, "CNAME")) {
         return RecordCNAME;
     }
-    else if (is("SOA")) {
+    else if (is(parser, "SOA")) {
         return RecordSOA;
     }
-    else if (is("PTR")) {
+    else if (is(parser, "PTR")) {
         return RecordPTR;
     }
-    else if (is("MX")) {
+    else if (is(parser, "MX")) {
         return RecordMX;
     }
-    else if (is("TXT")) {
+    else if (is(parser, "TXT")) {
         return RecordTXT;
     }
     else {
@@ -262,47 +277,160 @@ static dns_record_t is_type() {
 }
 
 static char is_relative(char* str){
-    while( *str ){ str++; }
-    str--;
-    return *str != '.'; 
+    size_t len = strlen(str);
+    return len == 0 || str[len - 1] != '.';
 }
 
-static char to_absolute(char* str){
-    while( *str ){ str++; }
-    *str = '.';
-    strcpy(++str, domain_zone);
+/**
+ * Append the origin to a relative domain.
+ *
+ * @param size size of the buffer of the domain
+ * @return 0 = success, -1 = the domain does not fit into the buffer
+ */
+static char to_absolute(parser_t* parser, char* str, uint16_t size) {
+    size_t len = strlen(str);
+    if (len + 1 + strlen(parser->domain_zone) + 1 > size) {
+        parser->overflow = 1;
+        return -1;
+    }
+    str[len] = '.';
+    strcpy(str + len + 1, parser->domain_zone);
+    return 0;
 }
 
-int16_t masterfile_parse(FILE* s) {
-    stream = s;
-    nextchar();
-    reset();
+/**
+ * Read the rest of a record after the domain: optional TTL and class, type
+ * and rdata. The first token has to be read already.
+ */
+static void read_record(parser_t* parser, uint32_t* ttl) {
+    char has_ttl = 0;
+    char has_class = 1;
+
+    *ttl = parser->default_ttl;
+    if (is_numeric(parser)) {
+        *ttl = atoi(parser->buf);
+        read_token(parser, 1);
+        has_ttl = 1;
+    }
+
+    // (optional) class, defaults to the last one
+    dns_class_t class = is_class(parser);
+    if(class){
+        parser->class = class;
+    }
+    else{
+        has_class = 0;
+    }
+
+    // type
+    if (has_class || has_ttl) {
+        read_token(parser, 1);
+    }
+
+    parser->type = is_type(parser);
+    
+    // rdata
+    if(parser->type == RecordA || 
+       parser->type == RecordNS || 
+       parser->type == RecordCNAME || 
+       parser->type == RecordPTR){ 
+        read_tokens(parser, 1); 
+    }
+    else if(parser->type == RecordMX){ 
+        read_tokens(parser, 2);
+    }
+    else if(parser->type == RecordSOA){
+        read_tokens(parser, 7);
+    }
+    else if(parser->type == RecordTXT){
+        read_token_eol(parser, 1);
+    }
+    
+    store_token(parser, parser->response);
+    
+    if(((parser->type == RecordNS) ||
+        (parser->type == RecordCNAME) ||
+        (parser->type == RecordMX))
+        && is_relative(parser->response)){
+        to_absolute(parser, parser->response, sizeof (parser->response));
+    }
+}
+
+/**
+ * Parse an included file with a parser of its own, which starts with the
+ * origin and the TTL of the including file.
+ */
+static int16_t include(parser_t* parser, char* path, char* origin){
+    if(parser->include_depth >= EMDNS_PARSER_INCLUDE_DEPTH){
+        return -1;
+    }
+    FILE* f = fopen(path, "r");
+    if(f == 0){
+        return -1;
+    }
+
+    parser_t* included = malloc(sizeof (parser_t));
+    if(included == 0){
+        fclose(f);
+        return -1;
+    }
+    memset(included, 0, sizeof (parser_t));
+    included->ctx = parser->ctx;
+    included->stream = f;
+    included->class = parser->class;
+    included->default_ttl = parser->default_ttl;
+    included->include_depth = parser->include_depth + 1;
+    strcpy(included->domain_zone, origin != 0 ? origin : parser->domain_zone);
+
+    int16_t records_added = parse(included);
+    free(included);
+    fclose(f);
+    return records_added;
+}
+
+int16_t masterfile_parse(emdns_ctx_t* ctx, FILE* stream) {
+    parser_t parser;
+    memset(&parser, 0, sizeof (parser));
+    parser.ctx = ctx;
+    parser.stream = stream;
+    parser.state = INIT;
+    parser.class = ClassIN;
+    return parse(&parser);
+}
+
+static int16_t parse(parser_t* parser) {
+    parser->p_buf = parser->buf;
+    nextchar(parser);
+    reset(parser);
     int16_t records_added = 0;
 
 
-    while (c != EOF) {
-        switch (state) {
+    while (parser->c != EOF) {
+        switch (parser->state) {
             case INIT:
-                ignore_whitespace();
-                if (c == DOLLAR) {
-                    state = COMMAND;
+                ignore_whitespace(parser);
+                if (parser->c == DOLLAR) {
+                    parser->state = COMMAND;
                 }
-                else if (!is_end_token()) {
-                    keep();
-                    state = RECORD;
+                else if (!is_end_token(parser)) {
+                    keep(parser);
+                    parser->state = RECORD;
                 }
                 break;
 
             case COMMAND:
-                read_token(0);
-                if (is("ORIGIN")) {
-                    state = ORIGIN;
+                read_token(parser, 0);
+                if (is(parser, "ORIGIN")) {
+                    parser->state = ORIGIN;
+                }
+                else if (is(parser, "INCLUDE")) {
+                    parser->state = INCLUDE;
                 }
-                else if (is("INCLUDE")) {
-                    return -1; // not supported
+                else if (is(parser, "GENERATE")) {
+                    parser->state = GENERATE;
                 }
-                else if(is("TTL")){
-                    state = TTL;
+                else if(is(parser, "TTL")){
+                    parser->state = TTL;
                 }
                 else {
                     return -1; // unknown
@@ -310,114 +438,151 @@ int16_t masterfile_parse(FILE* s) {
                 break;
 
             case ORIGIN:
-                read_token(1);
-                store_token(domain_zone);
-                if (!expect(NEWLINE)) {
+                read_token(parser, 1);
+                store_token(parser, parser->domain_zone);
+                if (!expect(parser, NEWLINE)) {
                     return -1; // unexpected token
                 }
                 else {
-                    state = INIT;
+                    parser->state = INIT;
                 }
                 break;
                 
+            case INCLUDE:
+            {
+                char path[EMDNS_PARSER_TEMPBUF];
+                char origin_buf[EMDNS_PARSER_NAME_MAX];
+                char* origin = 0;
+                read_token(parser, 1);
+                store_token(parser, path);
+                if (!expect(parser, NEWLINE) && parser->c != EOF) {
+                    // (optional) origin, relative to the current one
+                    read_token(parser, 1);
+                    if (is(parser, "@")) {
+                        strcpy(origin_buf, parser->domain_zone);
+                    }
+                    else {
+                        store_token(parser, origin_buf);
+                        if (is_relative(origin_buf)) {
+                            to_absolute(parser, origin_buf, sizeof (origin_buf));
+                        }
+                    }
+                    origin = origin_buf;
+                    if (!expect(parser, NEWLINE) && parser->c != EOF) {
+                        return -1; // unexpected token
+                    }
+                }
+                if (parser->overflow) {
+                    return -1;
+                }
+
+                int16_t included = include(parser, path, origin);
+                if (included < 0) {
+                    return -1;
+                }
+                records_added += included;
+                parser->state = INIT;
+            }
+                break;
+
+            case GENERATE:
+            {
+                uint32_t start, stop, step = 1;
+                char lhs[EMDNS_PARSER_NAME_MAX];
+
+                // range
+                read_token(parser, 1);
+                if (sscanf(parser->buf, "%u-%u/%u", &start, &stop, &step) < 2) {
+                    return -1;
+                }
+
+                // domain template
+                read_token(parser, 1);
+                if (is(parser, "@")) {
+                    strcpy(lhs, parser->domain_zone);
+                }
+                else {
+                    store_token(parser, lhs);
+                    if(is_relative(lhs)){
+                        to_absolute(parser, lhs, sizeof (lhs));
+                    }
+                }
+
+                read_token(parser, 1);
+                uint32_t ttl;
+                read_record(parser, &ttl);
+                if (parser->overflow) {
+                    return -1;
+                }
+
+                int added = emdns_add_generate(parser->ctx, start, stop, step, lhs, parser->type, parser->class, parser->response, ttl);
+                if (added != 0) {
+                    return -records_added;
+                }
+                records_added++;
+
+                if (!expect(parser, NEWLINE)) {
+                    if (parser->c != EOF) {
+                        return -1; // unexpected token
+                    }
+                }
+                else {
+                    parser->state = INIT;
+                }
+            }
+                break;
+
             case TTL:
-                read_token(1);
-                if(is_numeric()){
-                    default_ttl = atoi(buf);
+                read_token(parser, 1);
+                if(is_numeric(parser)){
+                    parser->default_ttl = atoi(parser->buf);
                 }
                 else{
                     return -1;
                 }
                     
-                if (!expect(NEWLINE)) {
+                if (!expect(parser, NEWLINE)) {
                     return -1; // unexpected token
                 }
                 else {
-                    state = INIT;
+                    parser->state = INIT;
                 }
                 break;
 
             case RECORD:
             {
-                char has_ttl = 0;
-                char has_class = 1;
                 char has_name = 1;
 
                 // name
-                read_token(0);
-                if (is("@")) {
+                read_token(parser, 0);
+                if (is(parser, "@")) {
                     // use origin domain
-                    strcpy(domain, domain_zone);
+                    strcpy(parser->domain, parser->domain_zone);
                 }
-                else if(is_class() || is_type()){
+                else if(is_class(parser) || is_type(parser)){
                     // empty string for domain - use last one
                     has_name = 0;
                 }
                 else {
                     // domain was read
-                    store_token(domain);
-                    if(is_relative(domain)){
-                        to_absolute(domain);
+                    store_token(parser, parser->domain);
+                    if(is_relative(parser->domain)){
+                        to_absolute(parser, parser->domain, sizeof (parser->domain));
                     }
                 }
 
                 // (optional) TTL
                 if(has_name){
-                    read_token(1);
-                }
-                uint32_t ttl = default_ttl;
-
-                if (is_numeric()) {
-                    ttl = atoi(buf);
-                    read_token(1);
-                    has_ttl = 1;
-                }
-
-                // (optional) class
-                class = is_class();
-                if(!class){
-                    has_class = 0;
+                    read_token(parser, 1);
                 }
-
-                // type
-                if (has_class || has_ttl) {
-                    read_token(1);
-                }
-
-                type = is_type();
-                
-                // rdata
-                if(type == RecordA || 
-                   type == RecordNS || 
-                   type == RecordCNAME || 
-                   type == RecordPTR){ 
-                    read_tokens(1); 
-                }
-                else if(type == RecordMX){ 
-                    read_tokens(2);
-                }
-                else if(type == RecordSOA){
-                    read_tokens(7);
-                }
-                else if(type == RecordTXT){
-                    read_token_eol(1);
-                }
-                
-                store_token(response);
-                
-                if(((type == RecordNS) ||
-                    (type == RecordCNAME) ||
-                    (type == RecordMX))
-                    && is_relative(response)){
-                    to_absolute(response);
+                uint32_t ttl;
+                read_record(parser, &ttl);
+                if (parser->overflow) {
+                    return -1;
                 }
 
                 // pass to emdns core
-#ifdef EMDNS_SUPPORT_ALL_CLASSES                     
-                int added = emdns_add_record(domain, type, class, response, ttl);
-#else
-                int added = emdns_add_record(domain, type, response, ttl);
-#endif                
+                int added = emdns_add_record(parser->ctx, parser->domain, parser->type, parser->class, parser->response, ttl);
                 if(added != 0)
                 {
                     // record was not added; return added entries as negative number
@@ -426,8 +591,8 @@ int16_t masterfile_parse(FILE* s) {
                 
                 records_added++;
 
-                if (!expect(NEWLINE)) {
-                    if (c == EOF) {
+                if (!expect(parser, NEWLINE)) {
+                    if (parser->c == EOF) {
                         // all good - continue
                     }
                     else {
@@ -435,13 +600,16 @@ int16_t masterfile_parse(FILE* s) {
                     }
                 }
                 else {
-                    state = INIT;
+                    parser->state = INIT;
                 }
             }
                 break;
         }
 
-        nextchar();
+        if (parser->overflow) {
+            return -1;
+        }
+        nextchar(parser);
     }
 
     return records_added;
@@ -3,8 +3,16 @@
 
 #include "stdio.h"
 #include "inttypes.h"
+#include "emdns.h"
 
-int16_t masterfile_parse(FILE* stream);
+/**
+ * Parse a master file (RFC 1035) and add its records to a context.
+ * 
+ * @param ctx context the records are added to
+ * @param stream the master file
+ * @return number of records added, negative on error
+ */
+int16_t masterfile_parse(emdns_ctx_t* ctx, FILE* stream);
 
 #endif /* MASTERFILE_H */
 
@@ -0,0 +1,329 @@
+/*
+ * Interned domain names.
+ *
+ * The labels are stored in a single arena, a reference is the offset of the
+ * label in the arena divided by 4. Every label refers to its parent, and is
+ * found via a hash table of (parent, label) pairs. Labels are reference
+ * counted, both by the users of the names and by the labels below them.
+ */
+#include "names.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stddef.h"
+
+// both grow by doubling, small zones stay small
+#define NAMES_ARENA_INIT 1024
+#define NAMES_BUCKETS_INIT 16
+#define NAMES_LABELS_MAX 128
+
+typedef struct {
+    uint32_t parent;
+    uint32_t next;  ///< next label in the bucket or in the free list
+    uint32_t refs;
+    uint8_t total;  ///< length of the whole name
+    uint8_t len;    ///< label is stored in DNS format, starting here
+    char label[];
+} name_node_t;
+
+/**
+ * Declaration of all helper functions.
+ */
+static name_node_t* _node(names_t* names, uint32_t name);
+static uint32_t _node_size(uint8_t len);
+static uint32_t _hash(uint32_t parent, char* label);
+static int _split(char* domain, uint8_t* starts);
+static uint32_t _find(names_t* names, uint32_t parent, char* label);
+static uint32_t _alloc(names_t* names, uint8_t len);
+static int _grow_buckets(names_t* names);
+static uint32_t _create(names_t* names, uint32_t parent, char* label);
+static void _collect(names_t* names, uint32_t name);
+
+/**
+ * Definition of all helper functions.
+ */
+static name_node_t* _node(names_t* names, uint32_t name) {
+    return (name_node_t*) (names->arena + ((size_t) name << 2));
+}
+
+static uint32_t _node_size(uint8_t len) {
+    return (offsetof(name_node_t, label) + len + 3) & ~3;
+}
+
+static uint32_t _hash(uint32_t parent, char* label) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < 4; i++) {
+        hash = (hash ^ ((parent >> (i * 8)) & 0xFF)) * 16777619u;
+    }
+    for (uint8_t i = 0; i <= (uint8_t) label[0]; i++) {
+        hash = (hash ^ (uint8_t) label[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the positions of the labels of a name.
+ *
+ * @return number of labels, -1 if the name is invalid
+ */
+static int _split(char* domain, uint8_t* starts) {
+    uint16_t total = strlen(domain);
+    uint16_t pos = 0;
+    int count = 0;
+    if (total > 254) {
+        return -1;
+    }
+    while (pos < total) {
+        uint8_t len = domain[pos];
+        if (len > 63 || pos + len + 1 > total || count == NAMES_LABELS_MAX) {
+            return -1;
+        }
+        starts[count++] = pos;
+        pos += len + 1;
+    }
+    return count;
+}
+
+static uint32_t _find(names_t* names, uint32_t parent, char* label) {
+    if (names->bucket_count == 0) {
+        return NAME_NONE;
+    }
+    uint32_t name = names->buckets[_hash(parent, label) & (names->bucket_count - 1)];
+    while (name != NAME_ROOT) {
+        name_node_t* node = _node(names, name);
+        // the label may be shorter than the node, compare the lengths first
+        if (node->parent == parent && node->len == (uint8_t) label[0] &&
+            memcmp(node->label, label + 1, node->len) == 0) {
+            return name;
+        }
+        name = node->next;
+    }
+    return NAME_NONE;
+}
+
+static uint32_t _alloc(names_t* names, uint8_t len) {
+    if (names->free_lists[len] != NAME_ROOT) {
+        uint32_t name = names->free_lists[len];
+        names->free_lists[len] = _node(names, name)->next;
+        names->free_bytes -= _node_size(len);
+        return name;
+    }
+
+    uint32_t size = _node_size(len);
+    if (names->arena_len == 0) {
+        // the root is never stored, but takes the first reference
+        names->arena_len = _node_size(0);
+    }
+    if ((uint64_t) names->arena_len + size > names->arena_size) {
+        uint64_t new_size = (names->arena_size == 0 ? NAMES_ARENA_INIT : (uint64_t) names->arena_size * 2);
+        if (new_size > 0xFFFFFFFC) {
+            new_size = 0xFFFFFFFC;
+        }
+        char* new_arena = (new_size >= (uint64_t) names->arena_len + size ? realloc(names->arena, new_size) : 0);
+        if (new_arena == 0) {
+            return NAME_NONE;
+        }
+        names->arena = new_arena;
+        names->arena_size = new_size;
+    }
+    uint32_t name = names->arena_len >> 2;
+    names->arena_len += size;
+    return name;
+}
+
+static int _grow_buckets(names_t* names) {
+    uint32_t count = (names->bucket_count == 0 ? NAMES_BUCKETS_INIT : names->bucket_count * 2);
+    uint32_t* table = calloc(count, sizeof (uint32_t));
+    if (table == 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < names->bucket_count; i++) {
+        uint32_t name = names->buckets[i];
+        while (name != NAME_ROOT) {
+            name_node_t* node = _node(names, name);
+            uint32_t next = node->next;
+            uint32_t bucket = _hash(node->parent, (char*) &node->len) & (count - 1);
+            node->next = table[bucket];
+            table[bucket] = name;
+            name = next;
+        }
+    }
+    free(names->buckets);
+    names->buckets = table;
+    names->bucket_count = count;
+    return 0;
+}
+
+static uint32_t _create(names_t* names, uint32_t parent, char* label) {
+    uint8_t len = label[0];
+    if (names->node_count >= names->bucket_count && _grow_buckets(names) != 0) {
+        return NAME_NONE;
+    }
+    uint32_t name = _alloc(names, len);
+    if (name == NAME_NONE) {
+        return NAME_NONE;
+    }
+
+    name_node_t* node = _node(names, name);
+    node->parent = parent;
+    node->refs = 0;
+    node->total = (parent != NAME_ROOT ? _node(names, parent)->total : 0) + len + 1;
+    memcpy(&node->len, label, len + 1);
+
+    uint32_t bucket = _hash(parent, label) & (names->bucket_count - 1);
+    node->next = names->buckets[bucket];
+    names->buckets[bucket] = name;
+    names->node_count++;
+    if (parent != NAME_ROOT) {
+        _node(names, parent)->refs++;
+    }
+    return name;
+}
+
+/**
+ * Free the label and its parents, as long as they are not referenced.
+ */
+static void _collect(names_t* names, uint32_t name) {
+    while (name != NAME_ROOT && _node(names, name)->refs == 0) {
+        name_node_t* node = _node(names, name);
+        uint32_t* link = &names->buckets[_hash(node->parent, (char*) &node->len) & (names->bucket_count - 1)];
+        while (*link != name) {
+            link = &_node(names, *link)->next;
+        }
+        *link = node->next;
+
+        node->next = names->free_lists[node->len];
+        names->free_lists[node->len] = name;
+        names->free_bytes += _node_size(node->len);
+        names->node_count--;
+
+        name = node->parent;
+        if (name != NAME_ROOT) {
+            _node(names, name)->refs--;
+        }
+    }
+}
+
+void names_init(names_t* names) {
+    memset(names, 0, sizeof (names_t));
+}
+
+void names_free(names_t* names) {
+    free(names->arena);
+    free(names->buckets);
+    names_init(names);
+}
+
+uint32_t names_intern(names_t* names, char* domain) {
+    uint8_t starts[NAMES_LABELS_MAX];
+    int count = _split(domain, starts);
+    if (count < 0) {
+        return NAME_NONE;
+    }
+
+    uint32_t name = NAME_ROOT;
+    for (int i = count - 1; i >= 0; i--) {
+        uint32_t child = _find(names, name, domain + starts[i]);
+        if (child == NAME_NONE) {
+            child = _create(names, name, domain + starts[i]);
+            if (child == NAME_NONE) {
+                _collect(names, name);
+                return NAME_NONE;
+            }
+        }
+        name = child;
+    }
+
+    if (name != NAME_ROOT) {
+        _node(names, name)->refs++;
+    }
+    names->unshared += strlen(domain) + 1;
+    return name;
+}
+
+void names_release(names_t* names, uint32_t name) {
+    names->unshared -= names_length(names, name) + 1;
+    if (name != NAME_ROOT) {
+        _node(names, name)->refs--;
+        _collect(names, name);
+    }
+}
+
+uint32_t names_lookup(names_t* names, char* domain) {
+    uint8_t starts[NAMES_LABELS_MAX];
+    int count = _split(domain, starts);
+    if (count < 0) {
+        return NAME_NONE;
+    }
+
+    uint32_t name = NAME_ROOT;
+    for (int i = count - 1; i >= 0 && name != NAME_NONE; i--) {
+        name = _find(names, name, domain + starts[i]);
+    }
+    return name;
+}
+
+uint32_t names_lookup_suffix(names_t* names, char* domain, uint16_t* prefix_len) {
+    uint8_t starts[NAMES_LABELS_MAX];
+    int count = _split(domain, starts);
+    *prefix_len = strlen(domain);
+    if (count < 0) {
+        return NAME_ROOT;
+    }
+
+    uint32_t name = NAME_ROOT;
+    for (int i = count - 1; i >= 0; i--) {
+        uint32_t child = _find(names, name, domain + starts[i]);
+        if (child == NAME_NONE) {
+            break;
+        }
+        name = child;
+        *prefix_len = starts[i];
+    }
+    return name;
+}
+
+uint16_t names_decode(names_t* names, uint32_t name, char* domain) {
+    char* p = domain;
+    while (name != NAME_ROOT) {
+        name_node_t* node = _node(names, name);
+        memcpy(p, &node->len, node->len + 1);
+        p += node->len + 1;
+        name = node->parent;
+    }
+    *p = '\0';
+    return p - domain;
+}
+
+uint8_t names_length(names_t* names, uint32_t name) {
+    return name != NAME_ROOT ? _node(names, name)->total : 0;
+}
+
+char* names_label(names_t* names, uint32_t name) {
+    return (char*) &_node(names, name)->len;
+}
+
+uint32_t names_parent(names_t* names, uint32_t name) {
+    return _node(names, name)->parent;
+}
+
+char names_in_zone(names_t* names, uint32_t name, uint32_t zone) {
+    // the zone can only be a suffix of the same or a shorter length
+    uint8_t zone_len = names_length(names, zone);
+    while (name != NAME_ROOT && names_length(names, name) > zone_len) {
+        name = _node(names, name)->parent;
+    }
+    return name == zone;
+}
+
+uint32_t names_count(names_t* names) {
+    return names->node_count;
+}
+
+uint64_t names_memory(names_t* names) {
+    return names->arena_len - names->free_bytes + (uint64_t) names->bucket_count * sizeof (uint32_t);
+}
+
+uint64_t names_memory_unshared(names_t* names) {
+    return names->unshared;
+}
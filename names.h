@@ -0,0 +1,133 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include "inttypes.h"
+
+/**
+ * Interned domain names. Every name is stored as a chain of labels, where
+ * each label refers to the interned name of its parent, so suffixes shared by
+ * many names (e.g. the zone) are stored only once. Names are referred to by
+ * 32 bit references, which are equal if and only if the names are equal.
+ *
+ * All names are passed in DNS format (length prefixed labels).
+ */
+
+#define NAME_ROOT 0
+#define NAME_NONE 0xFFFFFFFF
+
+/**
+ * Table of interned names. The references are only valid within the table.
+ */
+typedef struct {
+    char* arena;
+    uint32_t arena_len;
+    uint32_t arena_size;
+    uint32_t* buckets;
+    uint32_t bucket_count;
+    uint32_t node_count;
+    uint32_t free_lists[64];
+    uint64_t free_bytes;
+    uint64_t unshared;
+}
+names_t;
+
+/**
+ * Initialize an empty table.
+ *
+ * @param names the table
+ */
+void names_init(names_t* names);
+
+/**
+ * Free all names of a table. References to them must not be used anymore.
+ *
+ * @param names the table
+ */
+void names_free(names_t* names);
+
+/**
+ * Intern a name and take a reference to it.
+ *
+ * @param names the table
+ * @param domain domain name
+ * @return reference to the name, NAME_NONE on error
+ */
+uint32_t names_intern(names_t* names, char* domain);
+
+/**
+ * Release a reference taken by names_intern. The name is freed when the last
+ * reference is released.
+ *
+ * @param names the table
+ * @param name reference to the name
+ */
+void names_release(names_t* names, uint32_t name);
+
+/**
+ * Find an interned name without taking a reference.
+ *
+ * @param names the table
+ * @param domain domain name
+ * @return reference to the name, NAME_NONE if it is not interned
+ */
+uint32_t names_lookup(names_t* names, char* domain);
+
+/**
+ * Find the longest interned suffix of a name.
+ *
+ * @param names the table
+ * @param domain domain name
+ * @param prefix_len length of the part in front of the suffix will be stored here
+ * @return reference to the suffix, NAME_ROOT if there is none
+ */
+uint32_t names_lookup_suffix(names_t* names, char* domain, uint16_t* prefix_len);
+
+/**
+ * Write a name in DNS format, including the terminating zero.
+ *
+ * @param names the table
+ * @param name reference to the name
+ * @param domain buffer of at least 256 bytes
+ * @return length of the name without the terminating zero
+ */
+uint16_t names_decode(names_t* names, uint32_t name, char* domain);
+
+/**
+ * @return length of the name without the terminating zero
+ */
+uint8_t names_length(names_t* names, uint32_t name);
+
+/**
+ * @return the first label of the name (length prefixed), valid until the
+ *         next name is interned
+ */
+char* names_label(names_t* names, uint32_t name);
+
+/**
+ * @return the name without its first label
+ */
+uint32_t names_parent(names_t* names, uint32_t name);
+
+/**
+ * @return 1 if the name is equal to the zone or below it, 0 otherwise
+ */
+char names_in_zone(names_t* names, uint32_t name, uint32_t zone);
+
+/**
+ * @return number of interned labels
+ */
+uint32_t names_count(names_t* names);
+
+/**
+ * @return bytes of memory used by the interned names
+ */
+uint64_t names_memory(names_t* names);
+
+/**
+ * @return bytes of memory the names would use if every reference stored its
+ *         own copy
+ */
+uint64_t names_memory_unshared(names_t* names);
+
+#endif /* NAMES_H */
+
@@ -0,0 +1,254 @@
+/*
+ * Binary query log.
+ *
+ * The file consists of a 4 byte magic, followed by entries in the following
+ * format (all numbers in network byte order):
+ *   length (2) time (8) address (4) port (2) view (2)
+ *   flags (2) answer count (2) response length (2) question
+ * where length is the length of the rest of the entry, time is in nanoseconds
+ * since the epoch, flags are the flags of the response and question is the
+ * question section of the request as received (at most 260 bytes).
+ *
+ * The rings are single producer, single consumer queues of bytes. The
+ * producer only moves the head and the writer thread only moves the tail, so
+ * neither needs a lock. Entries are written to the file directly from the
+ * ring, in one system call for everything logged since the last round.
+ */
+#include "querylog.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "time.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "sys/uio.h"
+#include "arpa/inet.h"
+#include "dns.h"
+
+#define QUERYLOG_RINGS_MAX 64
+#define QUERYLOG_HEAD_SIZE 24
+#define QUERYLOG_QUESTION_MAX 260
+#define QUERYLOG_IDLE_NS 1000000
+#define QUERYLOG_CACHE_LINE 64
+
+static const char QUERYLOG_MAGIC[4] = {'E', 'M', 'Q', '1'};
+
+struct querylog_ring_t {
+    // the head is only written by the producer and the tail only by the
+    // writer, keep them on separate cache lines
+    _Alignas(QUERYLOG_CACHE_LINE) _Atomic uint64_t head;
+    uint64_t cached_tail;  ///< tail as last seen by the producer
+    _Atomic uint64_t dropped;
+    _Alignas(QUERYLOG_CACHE_LINE) _Atomic uint64_t tail;
+    _Alignas(QUERYLOG_CACHE_LINE) char* buf;
+    uint32_t mask;
+};
+
+static int fd = -1;
+static pthread_t writer;
+static querylog_ring_t* rings[QUERYLOG_RINGS_MAX];
+static _Atomic uint32_t ring_count = 0;
+static _Atomic char stopping = 0;
+
+/**
+ * Declaration of all helper functions.
+ */
+static uint64_t _drain(querylog_ring_t* ring);
+static void* _write_loop(void* arg);
+static void _ring_copy(querylog_ring_t* ring, uint64_t pos, char* data, uint32_t len);
+
+/**
+ * Definition of all helper functions.
+ */
+
+/**
+ * Write everything logged to a ring so far.
+ *
+ * @return number of bytes written
+ */
+static uint64_t _drain(querylog_ring_t* ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+
+    // the used part of the ring wraps around at most once
+    uint32_t start = tail & ring->mask;
+    uint64_t len = head - tail;
+    struct iovec iov[2] = {{ring->buf + start, len}, {ring->buf, 0}};
+    int count = 1;
+    if (start + len > ring->mask + 1) {
+        iov[0].iov_len = ring->mask + 1 - start;
+        iov[1].iov_base = ring->buf;
+        iov[1].iov_len = len - iov[0].iov_len;
+        count = 2;
+    }
+
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n <= 0) {
+            // the entries are lost, but the ring must not fill up
+            break;
+        }
+        if ((size_t) n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0] = iov[1];
+            count--;
+        }
+        iov[0].iov_base = (char*) iov[0].iov_base + n;
+        iov[0].iov_len -= n;
+    }
+
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    return len;
+}
+
+static void* _write_loop(void* arg) {
+    (void) arg;
+    while (1) {
+        // check before draining, so nothing logged before stopping is lost
+        char stop = atomic_load(&stopping);
+        uint64_t drained = 0;
+        uint32_t count = atomic_load_explicit(&ring_count, memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            drained += _drain(rings[i]);
+        }
+        if (stop) {
+            break;
+        }
+        if (drained == 0) {
+            // let the entries accumulate, to write them in larger batches
+            struct timespec idle = {0, QUERYLOG_IDLE_NS};
+            nanosleep(&idle, 0);
+        }
+    }
+    return 0;
+}
+
+static void _ring_copy(querylog_ring_t* ring, uint64_t pos, char* data, uint32_t len) {
+    uint32_t start = pos & ring->mask;
+    uint32_t chunk = ring->mask + 1 - start;
+    if (chunk >= len) {
+        memcpy(ring->buf + start, data, len);
+    }
+    else {
+        memcpy(ring->buf + start, data, chunk);
+        memcpy(ring->buf, data + chunk, len - chunk);
+    }
+}
+
+int querylog_open(char* path) {
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (lseek(fd, 0, SEEK_END) == 0 && write(fd, QUERYLOG_MAGIC, sizeof (QUERYLOG_MAGIC)) != sizeof (QUERYLOG_MAGIC)) {
+        close(fd);
+        return -1;
+    }
+    atomic_store(&stopping, 0);
+    if (pthread_create(&writer, 0, _write_loop, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+void querylog_close() {
+    atomic_store(&stopping, 1);
+    pthread_join(writer, 0);
+    close(fd);
+    fd = -1;
+}
+
+querylog_ring_t* querylog_ring_new(uint32_t size) {
+    uint32_t ring_size = 4096;
+    while (ring_size < size && ring_size < 0x80000000) {
+        ring_size <<= 1;
+    }
+
+    uint32_t index = atomic_load(&ring_count);
+    if (index == QUERYLOG_RINGS_MAX) {
+        return 0;
+    }
+    querylog_ring_t* ring = aligned_alloc(QUERYLOG_CACHE_LINE, sizeof (querylog_ring_t));
+    if (ring == 0) {
+        return 0;
+    }
+    memset(ring, 0, sizeof (querylog_ring_t));
+    ring->buf = malloc(ring_size);
+    if (ring->buf == 0) {
+        free(ring);
+        return 0;
+    }
+    ring->mask = ring_size - 1;
+
+    // rings are only ever added, the writer picks them up with the count
+    rings[index] = ring;
+    atomic_store_explicit(&ring_count, index + 1, memory_order_release);
+    return ring;
+}
+
+void querylog_query(querylog_ring_t* ring, struct sockaddr_in* client, uint16_t view,
+    char* request, uint16_t request_len, char* response, uint16_t response_len) {
+    char head[QUERYLOG_HEAD_SIZE];
+    uint16_t question_len = 0;
+    if (request_len > sizeof (dns_header_t)) {
+        question_len = request_len - sizeof (dns_header_t);
+        if (question_len > QUERYLOG_QUESTION_MAX) {
+            question_len = QUERYLOG_QUESTION_MAX;
+        }
+    }
+
+    uint64_t head_pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t len = QUERYLOG_HEAD_SIZE + question_len;
+    if (head_pos + len - ring->cached_tail > ring->mask + 1) {
+        // only look at the tail of the writer when the ring seems to be full
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head_pos + len - ring->cached_tail > ring->mask + 1) {
+            // only the producer writes the counter, no atomic increment needed
+            uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+            atomic_store_explicit(&ring->dropped, dropped + 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    uint16_t length = htons(len - 2);
+    uint32_t time_high = htonl(time >> 32);
+    uint32_t time_low = htonl(time & 0xFFFFFFFF);
+    uint16_t view_n = htons(view);
+    uint16_t flags = 0, ancount = 0;
+    uint16_t response_len_n = htons(response_len);
+    if (response_len >= sizeof (dns_header_t)) {
+        memcpy(&flags, response + 2, 2);
+        memcpy(&ancount, response + 6, 2);
+    }
+
+    memcpy(head, &length, 2);
+    memcpy(head + 2, &time_high, 4);
+    memcpy(head + 6, &time_low, 4);
+    memcpy(head + 10, &client->sin_addr.s_addr, 4);
+    memcpy(head + 14, &client->sin_port, 2);
+    memcpy(head + 16, &view_n, 2);
+    memcpy(head + 18, &flags, 2);
+    memcpy(head + 20, &ancount, 2);
+    memcpy(head + 22, &response_len_n, 2);
+
+    _ring_copy(ring, head_pos, head, QUERYLOG_HEAD_SIZE);
+    _ring_copy(ring, head_pos + QUERYLOG_HEAD_SIZE, request + sizeof (dns_header_t), question_len);
+    atomic_store_explicit(&ring->head, head_pos + len, memory_order_release);
+}
+
+uint64_t querylog_dropped() {
+    uint64_t dropped = 0;
+    uint32_t count = atomic_load_explicit(&ring_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        dropped += atomic_load_explicit(&rings[i]->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
@@ -0,0 +1,59 @@
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+#include "inttypes.h"
+#include "netinet/in.h"
+
+/**
+ * Binary log of queries and responses. Every thread serving queries logs to
+ * its own ring buffer, which is drained to the log file by a background
+ * writer thread, so logging a query costs a copy into memory and no system
+ * call. If a ring is full, the entry is dropped and counted.
+ */
+
+typedef struct querylog_ring_t querylog_ring_t;
+
+/**
+ * Open the log file and start the writer thread.
+ *
+ * @param path log file, entries are appended
+ * @return 0 = success, everything else is an error code
+ */
+int querylog_open(char* path);
+
+/**
+ * Stop the writer thread, once it has written all logged entries, and close
+ * the log file. The rings must not be used anymore.
+ */
+void querylog_close();
+
+/**
+ * Create the ring buffer of the calling thread. Only this thread may log
+ * to it.
+ *
+ * @param size size of the ring in bytes, rounded up to a power of two
+ * @return the ring, 0 on error
+ */
+querylog_ring_t* querylog_ring_new(uint32_t size);
+
+/**
+ * Log a query and the response to it.
+ *
+ * @param ring ring buffer of the calling thread
+ * @param client address of the client
+ * @param view view the client was served from
+ * @param request the request
+ * @param request_len length of the request
+ * @param response the response
+ * @param response_len length of the response
+ */
+void querylog_query(querylog_ring_t* ring, struct sockaddr_in* client, uint16_t view,
+    char* request, uint16_t request_len, char* response, uint16_t response_len);
+
+/**
+ * @return number of entries dropped because a ring was full
+ */
+uint64_t querylog_dropped();
+
+#endif /* QUERYLOG_H */
+
@@ -0,0 +1,150 @@
+/*
+ * Tests of the library, queries are resolved against contexts built per test:
+ *   test_emdns
+ * The tests stop at the first failure.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "../emdns.h"
+
+typedef struct {
+    uint16_t flags;
+    uint16_t ancount;
+    uint16_t len;
+} answer_t;
+
+/**
+ * Declaration of all helper functions.
+ */
+static void _encode_name(char* name, char* wire);
+static void _resolve(emdns_ctx_t* ctx, char* name, dns_record_t type, uint16_t response_max, answer_t* answer);
+static int _check(char* what, char condition);
+static int test_any_truncated(void);
+static int test_many_types(void);
+
+/**
+ * Definition of all helper functions.
+ */
+static void _encode_name(char* name, char* wire) {
+    while (*name != 0) {
+        char* dot = strchr(name, '.');
+        uint8_t len = (dot != 0 ? (size_t) (dot - name) : strlen(name));
+        *wire++ = len;
+        memcpy(wire, name, len);
+        wire += len;
+        name += len + (dot != 0);
+    }
+    *wire = 0;
+}
+
+/**
+ * Resolve a query of class IN.
+ *
+ * @param response_max space for the response
+ */
+static void _resolve(emdns_ctx_t* ctx, char* name, dns_record_t type, uint16_t response_max, answer_t* answer) {
+    char request[512] = {0x12, 0x34, 0, 0, 0, 1};
+    char response[4096];
+    _encode_name(name, request + 12);
+    uint16_t len = 12 + strlen(request + 12) + 1;
+    request[len++] = type >> 8;
+    request[len++] = type & 0xFF;
+    request[len++] = 0;
+    request[len++] = ClassIN;
+
+    emdns_resolve_raw(ctx, request, len, response, response_max, &answer->len);
+    answer->flags = ((uint8_t) response[2] << 8) | (uint8_t) response[3];
+    answer->ancount = ((uint8_t) response[6] << 8) | (uint8_t) response[7];
+}
+
+static int _check(char* what, char condition) {
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * An ANY query which can not be answered with a single RRset is truncated, so
+ * the client retries over TCP.
+ */
+static int test_any_truncated(void) {
+    emdns_ctx_t* ctx = emdns_ctx_new(0);
+    if (ctx == 0) {
+        return -1;
+    }
+    char text[] = "0123456789012345678901234567890123456789";
+    for (char i = 'a'; i < 'd'; i++) {
+        text[0] = i;
+        emdns_add_record(ctx, "big.test", RecordTXT, ClassIN, text, 300);
+    }
+
+    answer_t answer;
+    _resolve(ctx, "big.test", RecordANY, 512, &answer);
+    int res = _check("ANY answered", (answer.flags & 0x000F) == FlagNoError && answer.ancount == 3 &&
+        !(answer.flags & FlagTC));
+    if (res == 0) {
+        _resolve(ctx, "big.test", RecordANY, 100, &answer);
+        res = _check("ANY truncated", (answer.flags & 0x000F) == FlagNoError && answer.ancount == 0 &&
+            (answer.flags & FlagTC));
+    }
+    emdns_ctx_free(ctx);
+    return res;
+}
+
+/**
+ * Every RRset of a name with many types is answered, after records of the
+ * name were added and after one was removed.
+ */
+static int test_many_types(void) {
+    emdns_ctx_t* ctx = emdns_ctx_new(OptionFullAny);
+    if (ctx == 0) {
+        return -1;
+    }
+    char domain[] = "\4many\4test";
+    char rdata[2] = {0, 0};
+    emdns_change_t change = {ChangeAdd, domain, 0, ClassIN, 300, rdata, sizeof (rdata)};
+    for (uint16_t type = 100; type < 140; type++) {
+        change.record_type = type;
+        for (rdata[1] = 0; rdata[1] < 2; rdata[1]++) {
+            emdns_apply_change(ctx, &change);
+        }
+    }
+
+    answer_t answer;
+    int res = 0;
+    for (uint16_t type = 100; type < 140 && res == 0; type++) {
+        _resolve(ctx, "many.test", type, 512, &answer);
+        res = _check("type answered after adding", (answer.flags & 0x000F) == FlagNoError && answer.ancount == 2);
+    }
+    if (res == 0) {
+        _resolve(ctx, "many.test", RecordANY, 4096, &answer);
+        res = _check("ANY answered with all types", answer.ancount == 80);
+    }
+
+    change.op = ChangeDeleteRecord;
+    change.record_type = 100;
+    rdata[1] = 0;
+    emdns_apply_change(ctx, &change);
+    for (uint16_t type = 100; type < 140 && res == 0; type++) {
+        _resolve(ctx, "many.test", type, 512, &answer);
+        res = _check("type answered after removing", (answer.flags & 0x000F) == FlagNoError &&
+            answer.ancount == (type == 100 ? 1 : 2));
+    }
+    emdns_ctx_free(ctx);
+    return res;
+}
+
+int main(void) {
+    int (*tests[])(void) = {test_any_truncated, test_many_types};
+    for (size_t i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
+        if (tests[i]() != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    printf("All library tests passed.\n");
+    return EXIT_SUCCESS;
+}
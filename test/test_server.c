@@ -0,0 +1,370 @@
+/*
+ * Tests of the server, which is started with a small zone and queried over
+ * UDP from the loopback address:
+ *   test_server path/to/emdns
+ * Every test starts a server of its own, the tests stop at the first failure.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "inttypes.h"
+#include "unistd.h"
+#include "signal.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "sys/socket.h"
+#include "sys/wait.h"
+#include "sys/resource.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "../dns.h"
+
+#define PORT 5959
+#define TEST_ZONE \
+    "$ORIGIN test.\n" \
+    "@ 300 IN SOA ns admin 1 3600 900 604800 300\n" \
+    "@ 300 IN NS ns\n" \
+    "ns 300 IN A 192.0.2.1\n"
+
+typedef struct {
+    pid_t pid;
+    int sockfd;
+} server_t;
+
+typedef struct {
+    uint16_t rcode;
+    uint16_t ancount;
+    uint32_t serial;    ///< of an SOA answer, its last record
+} answer_t;
+
+static char* executable;
+
+/**
+ * Declaration of all helper functions.
+ */
+static int _start(server_t* server, char** args, rlim_t file_size);
+static void _stop(server_t* server);
+static uint16_t _put_name(char* p, char* name);
+static int _exchange(server_t* server, char* request, uint16_t request_len, answer_t* answer);
+static int _query(server_t* server, char* name, dns_record_t type, answer_t* answer);
+static int _update(server_t* server, char* name, char* ip, answer_t* answer);
+static int _control(char* path, char* command, char* output, size_t output_max);
+static int _check(char* what, char condition);
+static int test_update_allowed(void);
+static int test_update_refused(void);
+static int test_journal_failed(void);
+static int test_top_long_name(void);
+
+/**
+ * Definition of all helper functions.
+ */
+
+/**
+ * Start a server with the test zone and wait until it answers.
+ *
+ * @param args arguments of the server, 0 terminated
+ * @param file_size limit of the size of written files, RLIM_INFINITY = none
+ * @return 0 = success, -1 = the server did not start
+ */
+static int _start(server_t* server, char** args, rlim_t file_size) {
+    int zone[2];
+    if (pipe(zone) != 0) {
+        return -1;
+    }
+    server->pid = fork();
+    if (server->pid == 0) {
+        struct rlimit limit = {file_size, file_size};
+        int null = open("/dev/null", O_WRONLY);
+        // writes behind the limit fail instead of killing the server
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        dup2(zone[0], STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(zone[1]);
+        char* argv[16] = {executable};
+        for (uint8_t i = 0; args[i] != 0 && i < 14; i++) {
+            argv[i + 1] = args[i];
+        }
+        execv(executable, argv);
+        _exit(EXIT_FAILURE);
+    }
+    close(zone[0]);
+    if (server->pid < 0 || write(zone[1], TEST_ZONE, strlen(TEST_ZONE)) < 0) {
+        close(zone[1]);
+        return -1;
+    }
+    close(zone[1]);
+
+    server->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    answer_t answer;
+    for (uint8_t i = 0; i < 100; i++) {
+        if (_query(server, "ns.test", RecordA, &answer) == 0) {
+            return 0;
+        }
+    }
+    _stop(server);
+    return -1;
+}
+
+static void _stop(server_t* server) {
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, 0, 0);
+    close(server->sockfd);
+}
+
+/**
+ * @return length of the name in wire format
+ */
+static uint16_t _put_name(char* p, char* name) {
+    char* start = p;
+    while (*name != '\0') {
+        char* dot = strchr(name, '.');
+        uint8_t len = (dot != 0 ? (size_t) (dot - name) : strlen(name));
+        *p++ = len;
+        memcpy(p, name, len);
+        p += len;
+        name += len + (dot != 0);
+    }
+    *p++ = '\0';
+    return p - start;
+}
+
+/**
+ * Send a request and wait up to 50 ms for the answer.
+ *
+ * @return 0 = answered, -1 = no answer
+ */
+static int _exchange(server_t* server, char* request, uint16_t request_len, answer_t* answer) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sendto(server->sockfd, request, request_len, 0, (struct sockaddr*) &addr, sizeof (addr)) < 0) {
+        usleep(50000);
+        return -1;
+    }
+
+    struct pollfd fd = {.fd = server->sockfd, .events = POLLIN};
+    char response[512];
+    ssize_t len;
+    if (poll(&fd, 1, 50) != 1 || (len = recv(server->sockfd, response, sizeof (response), 0)) < 12) {
+        return -1;
+    }
+    answer->rcode = response[3] & 0x0F;
+    answer->ancount = ((uint8_t) response[6] << 8) | (uint8_t) response[7];
+    if (len >= 32) {
+        memcpy(&answer->serial, response + len - 20, sizeof (answer->serial));
+        answer->serial = ntohl(answer->serial);
+    }
+    return 0;
+}
+
+static int _query(server_t* server, char* name, dns_record_t type, answer_t* answer) {
+    char request[512] = {0x12, 0x34, 0, 0, 0, 1};
+    uint16_t len = 12 + _put_name(request + 12, name);
+    request[len++] = type >> 8;
+    request[len++] = type & 0xFF;
+    request[len++] = 0;
+    request[len++] = ClassIN;
+    return _exchange(server, request, len, answer);
+}
+
+/**
+ * Add an A record to the zone test with a dynamic update.
+ */
+static int _update(server_t* server, char* name, char* ip, answer_t* answer) {
+    char request[512] = {0x56, 0x78, FlagOpUpdate >> 8, 0, 0, 1, 0, 0, 0, 1, 0, 0};
+    uint16_t len = 12 + _put_name(request + 12, "test");
+    char zone[4] = {0, RecordSOA, 0, ClassIN};
+    memcpy(request + len, zone, sizeof (zone));
+    len += sizeof (zone);
+
+    len += _put_name(request + len, name);
+    char rr[10] = {0, RecordA, 0, ClassIN, 0, 0, 0x01, 0x2C, 0, 4};
+    memcpy(request + len, rr, sizeof (rr));
+    len += sizeof (rr);
+    inet_pton(AF_INET, ip, request + len);
+    len += 4;
+    return _exchange(server, request, len, answer);
+}
+
+/**
+ * Send a command to the control socket and read the whole output.
+ *
+ * @return 0 = success, -1 = the socket could not be used
+ */
+static int _control(char* path, char* command, char* output, size_t output_max) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof (addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof (addr)) != 0 ||
+        write(fd, command, strlen(command)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len < output_max - 1 && (n = read(fd, output + len, output_max - 1 - len)) > 0) {
+        len += n;
+    }
+    output[len] = '\0';
+    close(fd);
+    return 0;
+}
+
+static int _check(char* what, char condition) {
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Updates from the loopback address are accepted by default.
+ */
+static int test_update_allowed(void) {
+    char journal[] = "/tmp/emdns-test-XXXXXX";
+    int fd = mkstemp(journal);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    char* args[] = {"-j", journal, 0};
+    server_t server;
+    answer_t answer;
+    int res = _check("server started", _start(&server, args, RLIM_INFINITY) == 0);
+    if (res == 0) {
+        res = _check("update answered", _update(&server, "new.test", "192.0.2.2", &answer) == 0) ||
+            _check("update applied", answer.rcode == FlagNoError) ||
+            _check("query answered", _query(&server, "new.test", RecordA, &answer) == 0) ||
+            _check("record added", answer.rcode == FlagNoError && answer.ancount == 1);
+        _stop(&server);
+    }
+    unlink(journal);
+    return res;
+}
+
+/**
+ * Updates from an address outside of the prefixes of -U are refused.
+ */
+static int test_update_refused(void) {
+    char journal[] = "/tmp/emdns-test-XXXXXX";
+    int fd = mkstemp(journal);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    char* args[] = {"-j", journal, "-U", "10.0.0.0/8,192.168.0.0/16", 0};
+    server_t server;
+    answer_t answer;
+    int res = _check("server started", _start(&server, args, RLIM_INFINITY) == 0);
+    if (res == 0) {
+        res = _check("update answered", _update(&server, "new.test", "192.0.2.2", &answer) == 0) ||
+            _check("update refused", answer.rcode == FlagErrRefused) ||
+            _check("query answered", _query(&server, "new.test", RecordA, &answer) == 0) ||
+            _check("no record added", answer.ancount == 0);
+        _stop(&server);
+    }
+    unlink(journal);
+    return res;
+}
+
+/**
+ * Updates which can not be written to the journal are undone and answered
+ * with SERVFAIL, and further updates are refused. The server can only write
+ * the magic of the journal.
+ */
+static int test_journal_failed(void) {
+    char journal[] = "/tmp/emdns-test-XXXXXX";
+    int fd = mkstemp(journal);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    char* args[] = {"-j", journal, 0};
+    server_t server;
+    answer_t answer;
+    int res = _check("server started", _start(&server, args, 4) == 0);
+    if (res == 0) {
+        res = _check("update answered", _update(&server, "new.test", "192.0.2.2", &answer) == 0) ||
+            _check("update failed", answer.rcode == FlagErrServerFail) ||
+            _check("query answered", _query(&server, "new.test", RecordA, &answer) == 0) ||
+            _check("record removed", answer.ancount == 0) ||
+            _check("SOA answered", _query(&server, "test", RecordSOA, &answer) == 0) ||
+            _check("serial unchanged", answer.ancount == 1 && answer.serial == 1) ||
+            _check("next update answered", _update(&server, "new.test", "192.0.2.2", &answer) == 0) ||
+            _check("next update refused", answer.rcode == FlagErrRefused) ||
+            _check("query answered", _query(&server, "new.test", RecordA, &answer) == 0) ||
+            _check("no record added", answer.ancount == 0);
+        _stop(&server);
+    }
+    unlink(journal);
+    return res;
+}
+
+/**
+ * A query name longer than a key of the heavy hitters is counted with its
+ * type, the name is cut off in the key only.
+ */
+static int test_top_long_name(void) {
+    char control[] = "/tmp/emdns-test-XXXXXX";
+    int fd = mkstemp(control);
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    unlink(control);
+    char* args[] = {"-c", control, 0};
+    server_t server;
+    answer_t answer;
+    int res = _check("server started", _start(&server, args, RLIM_INFINITY) == 0);
+    if (res == 0) {
+        // five labels of 63 bytes, longer than any name
+        char request[512] = {0x12, 0x34, 0, 0, 0, 1};
+        uint16_t len = 12;
+        for (uint8_t i = 0; i < 5; i++) {
+            request[len++] = 63;
+            memset(request + len, 'a', 63);
+            len += 63;
+        }
+        request[len++] = 0;
+        char type[4] = {0x12, 0x34, 0, ClassIN};
+        memcpy(request + len, type, sizeof (type));
+        len += sizeof (type);
+
+        char output[4096];
+        res = _check("query answered", _exchange(&server, request, len, &answer) == 0) ||
+            _check("top answered", _control(control, "top\n", output, sizeof (output)) == 0) ||
+            _check("name counted with its type", strstr(output, " 4660\n") != 0);
+        _stop(&server);
+    }
+    unlink(control);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s emdns\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    executable = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+
+    int (*tests[])(void) = {test_update_allowed, test_update_refused, test_journal_failed,
+        test_top_long_name};
+    for (size_t i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
+        if (tests[i]() != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    printf("All server tests passed.\n");
+    return EXIT_SUCCESS;
+}
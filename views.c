@@ -0,0 +1,82 @@
+/*
+ * Longest prefix match of client addresses.
+ *
+ * Node 0 is the root and covers the first byte of the address, its children
+ * the second byte and so on. A prefix of length n is stored in the node of
+ * byte (n - 1) / 8, in all slots whose address starts with the prefix, unless
+ * a slot is already set by a longer prefix.
+ */
+#include "views.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define VIEWS_NODES_INIT 16
+
+/**
+ * Declaration of all helper functions.
+ */
+static int _new_node(views_t* views, uint32_t* node);
+
+/**
+ * Definition of all helper functions.
+ */
+static int _new_node(views_t* views, uint32_t* node) {
+    if (views->node_count == views->node_size) {
+        uint32_t size = (views->node_size == 0 ? VIEWS_NODES_INIT : views->node_size * 2);
+        views_node_t* nodes = realloc(views->nodes, size * sizeof (views_node_t));
+        if (nodes == 0) {
+            return -1;
+        }
+        views->nodes = nodes;
+        views->node_size = size;
+    }
+    memset(&views->nodes[views->node_count], 0, sizeof (views_node_t));
+    *node = views->node_count++;
+    return 0;
+}
+
+int views_init(views_t* views) {
+    uint32_t root;
+    memset(views, 0, sizeof (views_t));
+    return _new_node(views, &root);
+}
+
+void views_free(views_t* views) {
+    free(views->nodes);
+    memset(views, 0, sizeof (views_t));
+}
+
+int views_add(views_t* views, uint32_t addr, uint8_t prefix_len, uint16_t view) {
+    if (prefix_len == 0 || prefix_len > 32) {
+        return -1;
+    }
+
+    // find or create the node the prefix ends in
+    uint32_t node = 0;
+    uint8_t shift = 24;
+    for (uint8_t bits = 8; bits < prefix_len; bits += 8, shift -= 8) {
+        uint8_t byte = (addr >> shift) & 0xFF;
+        if (views->nodes[node].slots[byte].child == 0) {
+            // the node array may move, so do not keep pointers to it
+            uint32_t child;
+            if (_new_node(views, &child) != 0) {
+                return -1;
+            }
+            views->nodes[node].slots[byte].child = child;
+        }
+        node = views->nodes[node].slots[byte].child;
+    }
+
+    // expand the prefix to all slots it covers
+    uint8_t node_bits = prefix_len - (24 - shift);
+    uint16_t first = ((addr >> shift) & 0xFF) & (0xFF << (8 - node_bits));
+    uint16_t count = 1 << (8 - node_bits);
+    for (uint16_t i = first; i < first + count; i++) {
+        views_slot_t* slot = &views->nodes[node].slots[i];
+        if (slot->prefix_len <= prefix_len) {
+            slot->view = view;
+            slot->prefix_len = prefix_len;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef VIEWS_H
+#define VIEWS_H
+
+#include "inttypes.h"
+
+/**
+ * Table of client address prefixes (IPv4), used to select the view a client
+ * is served from. The longest matching prefix wins.
+ *
+ * The table is a multibit trie with a stride of 8 bits, where every prefix is
+ * expanded to all slots of its node it covers, so a lookup takes at most one
+ * memory access per byte of the address.
+ */
+
+#define VIEW_DEFAULT 0
+
+/**
+ * Slot of a trie node.
+ */
+typedef struct {
+    uint32_t child;      ///< index of the node for the next byte, 0 = none
+    uint16_t view;
+    uint8_t prefix_len;  ///< length of the prefix the view was set by, 0 = none
+} views_slot_t;
+
+typedef struct {
+    views_slot_t slots[256];
+} views_node_t;
+
+typedef struct {
+    views_node_t* nodes;
+    uint32_t node_count;
+    uint32_t node_size;
+} views_t;
+
+/**
+ * Initialize an empty table, every address maps to VIEW_DEFAULT.
+ *
+ * @param views the table
+ * @return 0 = success, -1 = out of memory
+ */
+int views_init(views_t* views);
+
+/**
+ * Free the table.
+ *
+ * @param views the table
+ */
+void views_free(views_t* views);
+
+/**
+ * Map all addresses of a prefix to a view. Prefixes may be added in any order.
+ *
+ * @param views the table
+ * @param addr address of the prefix, in host byte order
+ * @param prefix_len length of the prefix in bits (1 - 32)
+ * @param view the view
+ * @return 0 = success, -1 = invalid prefix or out of memory
+ */
+int views_add(views_t* views, uint32_t addr, uint8_t prefix_len, uint16_t view);
+
+/**
+ * Find the view of an address.
+ *
+ * @param views the table
+ * @param addr the address, in host byte order
+ * @return the view of the longest matching prefix, VIEW_DEFAULT if none matches
+ */
+static inline uint16_t views_find(views_t* views, uint32_t addr) {
+    uint16_t view = VIEW_DEFAULT;
+    views_slot_t* slot;
+    uint32_t node = 0;
+    for (uint8_t shift = 24;; shift -= 8) {
+        slot = &views->nodes[node].slots[(addr >> shift) & 0xFF];
+        if (slot->prefix_len != 0) {
+            view = slot->view;
+        }
+        node = slot->child;
+        if (node == 0 || shift == 0) {
+            return view;
+        }
+    }
+}
+
+#endif /* VIEWS_H */
+